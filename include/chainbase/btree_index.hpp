@@ -0,0 +1,557 @@
+#pragma once
+
+#include <boost/interprocess/offset_ptr.hpp>
+#include <boost/intrusive/parent_from_member.hpp>
+#include <boost/multi_index_container_fwd.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace chainbase {
+
+   template<typename T>
+   struct is_index_tag : std::false_type {};
+   template<typename... T>
+   struct is_index_tag<boost::multi_index::tag<T...>> : std::true_type {};
+
+   template<typename KeyFromValue, typename Compare>
+   struct btree_index_args {
+      using key_from_value_type = KeyFromValue;
+      using compare_type = std::conditional_t<std::is_void_v<Compare>, std::less<typename KeyFromValue::result_type>, Compare>;
+   };
+
+   /**
+    * An index specifier that can replace ordered_unique for any index of an undo_index except the first.
+    * It takes the same arguments: an optional tag, the key extractor and an optional comparison.
+    *
+    * The index is a B+tree that keeps copies of the keys in wide nodes, so that a lookup touches one
+    * node per level instead of one object per comparison.  The keys must be trivially copyable.
+    * Iterators remain valid as long as the object they refer to is in the index.
+    */
+   template<typename Arg1, typename Arg2 = void, typename Arg3 = void>
+   struct btree_unique : std::conditional_t<is_index_tag<Arg1>::value, btree_index_args<Arg2, Arg3>, btree_index_args<Arg1, Arg2>> {};
+
+   template<typename Index>
+   constexpr bool is_btree_index = false;
+   template<typename... T>
+   constexpr bool is_btree_index<btree_unique<T...>> = true;
+
+   // Links an object to the leaf that holds it
+   template<typename Index>
+   struct btree_hook {
+      btree_hook() = default;
+      btree_hook(const btree_hook&) {}
+      constexpr btree_hook& operator=(const btree_hook&) { return *this; }
+      boost::interprocess::offset_ptr<void> _leaf;
+   };
+
+   // B+tree over the nodes of an undo_index.  Nodes are either leaves, which hold keys and objects, or inner nodes,
+   // where _keys[i] separates _ptrs[i] and _ptrs[i+1].  Every key in a subtree is at least the separator to its left
+   // and at most the separator to its right.  All nodes except the root are at least half full.
+   //
+   // Tree nodes are never returned to the allocator while they may be needed again to restore a size that the index
+   // has had, so that neither undo nor repositioning a modified object needs to allocate.  Such nodes are kept on a
+   // spare list until trim() is called.
+   template<typename Node, typename Index>
+   class btree_impl {
+    public:
+      using value_type = typename Node::value_type;
+      using key_from_value_type = typename Index::key_from_value_type;
+      using key_type = std::decay_t<decltype(key_from_value_type{}(std::declval<const value_type&>()))>;
+      using key_compare = typename Index::compare_type;
+      static_assert(std::is_trivially_copyable_v<key_type>, "btree_unique requires a trivially copyable key");
+
+      struct value_compare {
+         bool operator()(const value_type& lhs, const value_type& rhs) const {
+            return key_compare{}(key_from_value_type{}(lhs), key_from_value_type{}(rhs));
+         }
+      };
+
+    private:
+      template<typename T>
+      using offset_ptr = boost::interprocess::offset_ptr<T>;
+      static constexpr std::size_t node_bytes = 512;
+      static constexpr std::size_t header_bytes = 4 * sizeof(offset_ptr<void>);
+      static constexpr std::size_t capacity = std::max<std::size_t>(4,
+         (node_bytes - header_bytes - sizeof(offset_ptr<void>)) / (sizeof(key_type) + sizeof(offset_ptr<void>)));
+      static constexpr std::size_t leaf_min = capacity / 2;
+      static constexpr std::size_t inner_min = (capacity + 1) / 2;
+
+      struct tree_node {
+         std::uint32_t _size = 0; // entries in a leaf, children in an inner node
+         bool _is_leaf = true;
+         offset_ptr<tree_node> _parent;
+         offset_ptr<tree_node> _prev; // leaves only
+         offset_ptr<tree_node> _next; // leaves, and the spare list
+         key_type _keys[capacity];
+         offset_ptr<void> _ptrs[capacity + 1];
+         tree_node* child(std::size_t i) const { return static_cast<tree_node*>(_ptrs[i].get()); }
+         value_type* value(std::size_t i) const { return static_cast<value_type*>(_ptrs[i].get()); }
+      };
+
+      using allocator_type = typename std::allocator_traits<typename Node::allocator_type>::template rebind_alloc<tree_node>;
+      using alloc_traits = std::allocator_traits<allocator_type>;
+
+    public:
+      class const_iterator {
+       public:
+         using iterator_category = std::bidirectional_iterator_tag;
+         using value_type = typename btree_impl::value_type;
+         using difference_type = std::ptrdiff_t;
+         using pointer = const value_type*;
+         using reference = const value_type&;
+
+         const_iterator() = default;
+         reference operator*() const { return *_value; }
+         pointer operator->() const { return _value; }
+         const_iterator& operator++() {
+            auto [leaf, pos] = locate(*_value, _pos);
+            if(pos + 1 < leaf->_size) set(leaf, pos + 1);
+            else if(leaf->_next) set(leaf->_next.get(), 0);
+            else _value = nullptr;
+            return *this;
+         }
+         const_iterator operator++(int) { auto result = *this; ++*this; return result; }
+         const_iterator& operator--() {
+            if(!_value) {
+               tree_node* leaf = _tree->_tail.get();
+               set(leaf, leaf->_size - 1);
+            } else {
+               auto [leaf, pos] = locate(*_value, _pos);
+               if(pos > 0) set(leaf, pos - 1);
+               else set(leaf->_prev.get(), leaf->_prev->_size - 1);
+            }
+            return *this;
+         }
+         const_iterator operator--(int) { auto result = *this; --*this; return result; }
+         friend bool operator==(const const_iterator& lhs, const const_iterator& rhs) { return lhs._value == rhs._value; }
+         friend bool operator!=(const const_iterator& lhs, const const_iterator& rhs) { return lhs._value != rhs._value; }
+       private:
+         friend class btree_impl;
+         const_iterator(const btree_impl* tree, const value_type* value, std::uint32_t pos) : _tree(tree), _value(value), _pos(pos) {}
+         void set(const tree_node* leaf, std::uint32_t pos) { _value = leaf->value(pos); _pos = pos; }
+         const btree_impl* _tree = nullptr;
+         const value_type* _value = nullptr;
+         std::uint32_t _pos = 0; // where _value was last seen in its leaf
+      };
+      using iterator = const_iterator;
+      using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+      using reverse_iterator = const_reverse_iterator;
+
+      btree_impl() = default;
+      template<typename A>
+      explicit btree_impl(const A& a) : _allocator(a) {}
+      btree_impl(const btree_impl&) = delete;
+      btree_impl& operator=(const btree_impl&) = delete;
+      ~btree_impl() {
+         clear();
+         release_spares(0);
+      }
+
+      const_iterator begin() const { return _head ? const_iterator{this, _head->value(0), 0} : end(); }
+      const_iterator end() const { return const_iterator{this, nullptr, 0}; }
+      const_reverse_iterator rbegin() const { return const_reverse_iterator{end()}; }
+      const_reverse_iterator rend() const { return const_reverse_iterator{begin()}; }
+      std::size_t size() const { return _size; }
+      bool empty() const { return _size == 0; }
+      key_compare key_comp() const { return key_compare{}; }
+      value_compare value_comp() const { return value_compare{}; }
+
+      const_iterator iterator_to(const value_type& v) const { return const_iterator{this, &v, 0}; }
+
+      template<typename K>
+      const_iterator find(const K& k) const {
+         auto [leaf, pos] = next_entry(lower_bound_entry(k));
+         if(leaf && !key_compare{}(k, leaf->_keys[pos])) return make_iterator(leaf, pos);
+         return end();
+      }
+      template<typename K>
+      const_iterator lower_bound(const K& k) const {
+         auto [leaf, pos] = next_entry(lower_bound_entry(k));
+         return make_iterator(leaf, pos);
+      }
+      template<typename K>
+      const_iterator upper_bound(const K& k) const {
+         auto [leaf, pos] = next_entry(upper_bound_entry(k));
+         return make_iterator(leaf, pos);
+      }
+      template<typename K>
+      std::pair<const_iterator, const_iterator> equal_range(const K& k) const {
+         return { lower_bound(k), upper_bound(k) };
+      }
+
+      // Exception safety: strong.  Does not allocate unless the index is larger than it has been since the last trim.
+      std::pair<const_iterator, bool> insert_unique(value_type& v) {
+         key_type k = key_from_value_type{}(v);
+         auto [leaf, pos] = lower_bound_entry(k);
+         auto [next_leaf, next_pos] = next_entry({leaf, pos});
+         if(next_leaf && !key_compare{}(k, next_leaf->_keys[next_pos]))
+            return { make_iterator(next_leaf, next_pos), false };
+         reserve(_size + 1);
+         insert_at(leaf, pos, k, v);
+         return { iterator_to(v), true };
+      }
+      const_iterator insert_equal(value_type& v) {
+         key_type k = key_from_value_type{}(v);
+         auto [leaf, pos] = upper_bound_entry(k);
+         reserve(_size + 1);
+         insert_at(leaf, pos, k, v);
+         return iterator_to(v);
+      }
+
+      const_iterator erase(const_iterator it) noexcept {
+         const_iterator next = std::next(it);
+         auto [leaf, pos] = locate(*it, it._pos);
+         erase_at(leaf, pos);
+         return next;
+      }
+
+      // Moves v to its place after its key may have changed.  If unique and another object has the same key,
+      // returns false and leaves v in the index next to it.
+      bool update(value_type& v, bool unique) noexcept {
+         auto [leaf, pos] = locate(v, 0);
+         key_type k = key_from_value_type{}(v);
+         key_compare comp;
+         if(!comp(leaf->_keys[pos], k) && !comp(k, leaf->_keys[pos]))
+            return true;
+         if(pos > 0 && pos + 1 < leaf->_size && comp(leaf->_keys[pos - 1], k) && comp(k, leaf->_keys[pos + 1])) {
+            leaf->_keys[pos] = k;
+            return true;
+         }
+         erase_at(leaf, pos);
+         if(unique && !insert_unique(v).second) {
+            insert_equal(v);
+            return false;
+         }
+         if(!unique)
+            insert_equal(v);
+         return true;
+      }
+
+      void clear() noexcept {
+         if(_root) free_subtree(_root.get());
+         _root = _head = _tail = nullptr;
+         _size = 0;
+      }
+
+      // Returns the spare tree nodes that are not needed to hold the current contents to the allocator
+      void trim() noexcept { release_spares(max_nodes(_size)); }
+
+      // Bytes of tree nodes, including spares
+      std::size_t allocated_bytes() const { return (_node_count + _spare_count) * sizeof(tree_node); }
+
+    private:
+      // The most tree nodes that can hold n objects
+      static std::size_t max_nodes(std::size_t n) {
+         if(n == 0) return 0;
+         std::size_t level = (n + leaf_min - 1) / leaf_min;
+         std::size_t result = level;
+         while(level > 1) {
+            level = (level + inner_min - 1) / inner_min;
+            result += level;
+         }
+         return result;
+      }
+
+      static btree_hook<Index>& hook_of(const value_type& v) {
+         auto* holder = boost::intrusive::get_parent_from_member(const_cast<value_type*>(&v), &Node::_item);
+         return static_cast<btree_hook<Index>&>(*static_cast<Node*>(holder));
+      }
+      static std::pair<tree_node*, std::uint32_t> locate(const value_type& v, std::uint32_t hint) {
+         tree_node* leaf = static_cast<tree_node*>(hook_of(v)._leaf.get());
+         if(hint < leaf->_size && leaf->value(hint) == &v) return { leaf, hint };
+         std::uint32_t pos = 0;
+         while(leaf->value(pos) != &v) ++pos;
+         return { leaf, pos };
+      }
+
+      template<typename K>
+      std::pair<tree_node*, std::uint32_t> lower_bound_entry(const K& k) const {
+         tree_node* n = _root.get();
+         if(!n) return { nullptr, 0 };
+         while(!n->_is_leaf)
+            n = n->child(std::lower_bound(n->_keys, n->_keys + n->_size - 1, k, key_compare{}) - n->_keys);
+         return { n, std::lower_bound(n->_keys, n->_keys + n->_size, k, key_compare{}) - n->_keys };
+      }
+      template<typename K>
+      std::pair<tree_node*, std::uint32_t> upper_bound_entry(const K& k) const {
+         tree_node* n = _root.get();
+         if(!n) return { nullptr, 0 };
+         while(!n->_is_leaf)
+            n = n->child(std::upper_bound(n->_keys, n->_keys + n->_size - 1, k, key_compare{}) - n->_keys);
+         return { n, std::upper_bound(n->_keys, n->_keys + n->_size, k, key_compare{}) - n->_keys };
+      }
+      // Moves a position past the end of a leaf to the start of the next one
+      static std::pair<tree_node*, std::uint32_t> next_entry(std::pair<tree_node*, std::uint32_t> entry) {
+         if(entry.first && entry.second == entry.first->_size) return { entry.first->_next.get(), 0 };
+         return entry;
+      }
+      const_iterator make_iterator(tree_node* leaf, std::uint32_t pos) const {
+         return leaf ? const_iterator{this, leaf->value(pos), pos} : end();
+      }
+
+      void reserve(std::size_t n) {
+         for(std::size_t needed = max_nodes(n); _node_count + _spare_count < needed;) {
+            auto p = alloc_traits::allocate(_allocator, 1);
+            tree_node* result = new (&*p) tree_node;
+            result->_next = _spare;
+            _spare = result;
+            ++_spare_count;
+         }
+      }
+      void release_spares(std::size_t keep) noexcept {
+         while(_spare && _node_count + _spare_count > keep) {
+            tree_node* n = _spare.get();
+            _spare = n->_next;
+            --_spare_count;
+            n->~tree_node();
+            alloc_traits::deallocate(_allocator, typename alloc_traits::pointer{n}, 1);
+         }
+      }
+      tree_node* take_node(bool is_leaf) noexcept {
+         assert(_spare);
+         tree_node* result = _spare.get();
+         _spare = result->_next;
+         --_spare_count;
+         ++_node_count;
+         new (result) tree_node;
+         result->_is_leaf = is_leaf;
+         return result;
+      }
+      void free_node(tree_node* n) noexcept {
+         n->~tree_node();
+         n = new (n) tree_node;
+         n->_next = _spare;
+         _spare = n;
+         ++_spare_count;
+         --_node_count;
+      }
+      void free_subtree(tree_node* n) noexcept {
+         if(!n->_is_leaf) {
+            for(std::uint32_t i = 0; i < n->_size; ++i)
+               free_subtree(n->child(i));
+         }
+         free_node(n);
+      }
+
+      void set_entry(tree_node* leaf, std::uint32_t pos, const key_type& k, void* v) noexcept {
+         leaf->_keys[pos] = k;
+         leaf->_ptrs[pos] = v;
+         hook_of(*leaf->value(pos))._leaf = leaf;
+      }
+
+      void insert_at(tree_node* leaf, std::uint32_t pos, const key_type& k, value_type& v) noexcept {
+         if(!leaf) {
+            leaf = take_node(true);
+            _root = _head = _tail = leaf;
+         } else if(leaf->_size == capacity) {
+            tree_node* right = take_node(true);
+            split_leaf(leaf, right);
+            if(pos > leaf->_size) {
+               pos -= leaf->_size;
+               leaf = right;
+            }
+         }
+         std::copy_backward(leaf->_keys + pos, leaf->_keys + leaf->_size, leaf->_keys + leaf->_size + 1);
+         std::copy_backward(leaf->_ptrs + pos, leaf->_ptrs + leaf->_size, leaf->_ptrs + leaf->_size + 1);
+         set_entry(leaf, pos, k, &v);
+         ++leaf->_size;
+         ++_size;
+      }
+
+      void split_leaf(tree_node* leaf, tree_node* right) noexcept {
+         const std::uint32_t keep = capacity / 2;
+         for(std::uint32_t i = keep; i < leaf->_size; ++i)
+            set_entry(right, i - keep, leaf->_keys[i], leaf->_ptrs[i].get());
+         right->_size = leaf->_size - keep;
+         leaf->_size = keep;
+         right->_next = leaf->_next;
+         if(right->_next) right->_next->_prev = right;
+         else _tail = right;
+         right->_prev = leaf;
+         leaf->_next = right;
+         insert_child(leaf, right->_keys[0], right);
+      }
+
+      static std::uint32_t child_index(const tree_node* parent, const tree_node* child) {
+         std::uint32_t i = 0;
+         while(parent->child(i) != child) ++i;
+         return i;
+      }
+
+      // Adds right to the parent of left, just after it
+      void insert_child(tree_node* left, const key_type& separator, tree_node* right) noexcept {
+         tree_node* parent = left->_parent.get();
+         if(!parent) {
+            parent = take_node(false);
+            _root = parent;
+            parent->_ptrs[0] = left;
+            parent->_size = 1;
+            left->_parent = parent;
+         }
+         const std::uint32_t i = child_index(parent, left);
+         if(parent->_size < capacity + 1) {
+            std::copy_backward(parent->_keys + i, parent->_keys + parent->_size - 1, parent->_keys + parent->_size);
+            std::copy_backward(parent->_ptrs + i + 1, parent->_ptrs + parent->_size, parent->_ptrs + parent->_size + 1);
+            parent->_keys[i] = separator;
+            parent->_ptrs[i + 1] = right;
+            ++parent->_size;
+            right->_parent = parent;
+            return;
+         }
+         key_type keys[capacity + 1];
+         tree_node* children[capacity + 2];
+         std::copy(parent->_keys, parent->_keys + i, keys);
+         keys[i] = separator;
+         std::copy(parent->_keys + i, parent->_keys + capacity, keys + i + 1);
+         for(std::uint32_t j = 0; j <= i; ++j) children[j] = parent->child(j);
+         children[i + 1] = right;
+         for(std::uint32_t j = i + 1; j < capacity + 1; ++j) children[j + 1] = parent->child(j);
+
+         tree_node* sibling = take_node(false);
+         const std::uint32_t left_children = (capacity + 2) / 2;
+         parent->_size = left_children;
+         sibling->_size = capacity + 2 - left_children;
+         for(std::uint32_t j = 0; j < left_children; ++j) {
+            parent->_ptrs[j] = children[j];
+            children[j]->_parent = parent;
+         }
+         std::copy(keys, keys + left_children - 1, parent->_keys);
+         for(std::uint32_t j = left_children; j < capacity + 2; ++j) {
+            sibling->_ptrs[j - left_children] = children[j];
+            children[j]->_parent = sibling;
+         }
+         std::copy(keys + left_children, keys + capacity + 1, sibling->_keys);
+         insert_child(parent, keys[left_children - 1], sibling);
+      }
+
+      void erase_at(tree_node* leaf, std::uint32_t pos) noexcept {
+         std::copy(leaf->_keys + pos + 1, leaf->_keys + leaf->_size, leaf->_keys + pos);
+         std::copy(leaf->_ptrs + pos + 1, leaf->_ptrs + leaf->_size, leaf->_ptrs + pos);
+         --leaf->_size;
+         --_size;
+         if(leaf == _root.get()) {
+            if(leaf->_size == 0) {
+               free_node(leaf);
+               _root = _head = _tail = nullptr;
+            }
+         } else if(leaf->_size < leaf_min) {
+            rebalance_leaf(leaf);
+         }
+      }
+
+      void rebalance_leaf(tree_node* leaf) noexcept {
+         tree_node* parent = leaf->_parent.get();
+         const std::uint32_t i = child_index(parent, leaf);
+         tree_node* left = i > 0 ? parent->child(i - 1) : nullptr;
+         tree_node* right = i + 1 < parent->_size ? parent->child(i + 1) : nullptr;
+         if(left && left->_size > leaf_min) {
+            std::copy_backward(leaf->_keys, leaf->_keys + leaf->_size, leaf->_keys + leaf->_size + 1);
+            std::copy_backward(leaf->_ptrs, leaf->_ptrs + leaf->_size, leaf->_ptrs + leaf->_size + 1);
+            --left->_size;
+            set_entry(leaf, 0, left->_keys[left->_size], left->_ptrs[left->_size].get());
+            ++leaf->_size;
+            parent->_keys[i - 1] = leaf->_keys[0];
+         } else if(right && right->_size > leaf_min) {
+            set_entry(leaf, leaf->_size, right->_keys[0], right->_ptrs[0].get());
+            ++leaf->_size;
+            std::copy(right->_keys + 1, right->_keys + right->_size, right->_keys);
+            std::copy(right->_ptrs + 1, right->_ptrs + right->_size, right->_ptrs);
+            --right->_size;
+            parent->_keys[i] = right->_keys[0];
+         } else if(left) {
+            merge_leaves(left, leaf);
+            erase_child(parent, i);
+         } else {
+            merge_leaves(leaf, right);
+            erase_child(parent, i + 1);
+         }
+      }
+
+      void merge_leaves(tree_node* left, tree_node* right) noexcept {
+         for(std::uint32_t i = 0; i < right->_size; ++i)
+            set_entry(left, left->_size + i, right->_keys[i], right->_ptrs[i].get());
+         left->_size += right->_size;
+         left->_next = right->_next;
+         if(left->_next) left->_next->_prev = left;
+         else _tail = left;
+         free_node(right);
+      }
+
+      // Removes child i, which was merged into child i - 1, and the separator between them
+      void erase_child(tree_node* parent, std::uint32_t i) noexcept {
+         std::copy(parent->_keys + i, parent->_keys + parent->_size - 1, parent->_keys + i - 1);
+         std::copy(parent->_ptrs + i + 1, parent->_ptrs + parent->_size, parent->_ptrs + i);
+         --parent->_size;
+         if(parent == _root.get()) {
+            if(parent->_size == 1) {
+               _root = parent->child(0);
+               _root->_parent = nullptr;
+               free_node(parent);
+            }
+         } else if(parent->_size < inner_min) {
+            rebalance_inner(parent);
+         }
+      }
+
+      void rebalance_inner(tree_node* n) noexcept {
+         tree_node* parent = n->_parent.get();
+         const std::uint32_t i = child_index(parent, n);
+         tree_node* left = i > 0 ? parent->child(i - 1) : nullptr;
+         tree_node* right = i + 1 < parent->_size ? parent->child(i + 1) : nullptr;
+         if(left && left->_size > inner_min) {
+            std::copy_backward(n->_keys, n->_keys + n->_size - 1, n->_keys + n->_size);
+            std::copy_backward(n->_ptrs, n->_ptrs + n->_size, n->_ptrs + n->_size + 1);
+            n->_keys[0] = parent->_keys[i - 1];
+            n->_ptrs[0] = left->_ptrs[left->_size - 1];
+            n->child(0)->_parent = n;
+            ++n->_size;
+            parent->_keys[i - 1] = left->_keys[left->_size - 2];
+            --left->_size;
+         } else if(right && right->_size > inner_min) {
+            n->_keys[n->_size - 1] = parent->_keys[i];
+            n->_ptrs[n->_size] = right->_ptrs[0];
+            n->child(n->_size)->_parent = n;
+            ++n->_size;
+            parent->_keys[i] = right->_keys[0];
+            std::copy(right->_keys + 1, right->_keys + right->_size - 1, right->_keys);
+            std::copy(right->_ptrs + 1, right->_ptrs + right->_size, right->_ptrs);
+            --right->_size;
+         } else if(left) {
+            merge_inner(left, parent->_keys[i - 1], n);
+            erase_child(parent, i);
+         } else {
+            merge_inner(n, parent->_keys[i], right);
+            erase_child(parent, i + 1);
+         }
+      }
+
+      void merge_inner(tree_node* left, const key_type& separator, tree_node* right) noexcept {
+         left->_keys[left->_size - 1] = separator;
+         std::copy(right->_keys, right->_keys + right->_size - 1, left->_keys + left->_size);
+         for(std::uint32_t i = 0; i < right->_size; ++i) {
+            left->_ptrs[left->_size + i] = right->_ptrs[i];
+            right->child(i)->_parent = left;
+         }
+         left->_size += right->_size;
+         free_node(right);
+      }
+
+      allocator_type        _allocator;
+      offset_ptr<tree_node> _root;
+      offset_ptr<tree_node> _head;
+      offset_ptr<tree_node> _tail;
+      offset_ptr<tree_node> _spare;
+      std::size_t           _size = 0;
+      std::size_t           _node_count = 0;
+      std::size_t           _spare_count = 0;
+   };
+
+}
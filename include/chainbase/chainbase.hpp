@@ -21,8 +21,12 @@
 
 #include <array>
 #include <atomic>
+#include <algorithm>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <stdexcept>
 #include <typeindex>
 #include <typeinfo>
@@ -134,46 +138,27 @@ namespace chainbase {
    template<typename MultiIndexType>
    using generic_index = multi_index_to_undo_index<MultiIndexType>;
 
-   class abstract_session {
-      public:
-         virtual ~abstract_session(){};
-         virtual void push()             = 0;
-         virtual void squash()           = 0;
-         virtual void undo()             = 0;
-   };
-
-   template<typename SessionType>
-   class session_impl : public abstract_session
-   {
-      public:
-         session_impl( SessionType&& s ):_session( std::move( s ) ){}
-
-         virtual void push() override  { _session.push();  }
-         virtual void squash() override{ _session.squash(); }
-         virtual void undo() override  { _session.undo();  }
-      private:
-         SessionType _session;
-   };
-
    class abstract_index
    {
       public:
          abstract_index( void* i ):_idx_ptr(i){}
          virtual ~abstract_index(){}
          virtual void     set_revision( uint64_t revision ) = 0;
-         virtual unique_ptr<abstract_session> start_undo_session( bool enabled ) = 0;
 
          virtual int64_t revision()const = 0;
-         virtual void    undo()const = 0;
-         virtual void    squash()const = 0;
-         virtual void    commit( int64_t revision )const = 0;
-         virtual void    undo_all()const = 0;
+         virtual void    undo_touched()const = 0;
+         virtual bool    squash_touched()const = 0;
+         virtual void    commit_undo_states( int64_t revision )const = 0;
+         virtual size_t  session_records()const = 0;
+         virtual size_t  reclaim( size_t max_records )const = 0;
          virtual uint32_t type_id()const  = 0;
          virtual uint64_t row_count()const = 0;
          virtual const std::string& type_name()const = 0;
          virtual std::pair<int64_t, int64_t> undo_stack_revision_range()const = 0;
 
          virtual void remove_object( int64_t id ) = 0;
+         virtual void copy_into( abstract_index& dest )const = 0;
+         virtual undo_index_memory_stats memory_stats()const = 0;
 
          void* get()const { return _idx_ptr; }
       private:
@@ -185,22 +170,21 @@ namespace chainbase {
       public:
          index_impl( BaseIndex& base ):abstract_index( &base ),_base(base){}
 
-         virtual unique_ptr<abstract_session> start_undo_session( bool enabled ) override {
-            return unique_ptr<abstract_session>(new session_impl<typename BaseIndex::session>( _base.start_undo_session( enabled ) ) );
-         }
-
          virtual void     set_revision( uint64_t revision ) override { _base.set_revision( revision ); }
          virtual int64_t  revision()const  override { return _base.revision(); }
-         virtual void     undo()const  override { _base.undo(); }
-         virtual void     squash()const  override { _base.squash(); }
-         virtual void     commit( int64_t revision )const  override { _base.commit(revision); }
-         virtual void     undo_all() const override {_base.undo_all(); }
+         virtual void     undo_touched()const  override { _base.undo_touched(); }
+         virtual bool     squash_touched()const  override { return _base.squash_touched(); }
+         virtual void     commit_undo_states( int64_t revision )const  override { _base.commit_undo_states(revision); }
+         virtual size_t   session_records()const  override { return _base.session_records(); }
+         virtual size_t   reclaim( size_t max_records )const  override { return _base.reclaim( max_records ); }
          virtual uint32_t type_id()const override { return BaseIndex::value_type::type_id; }
          virtual uint64_t row_count()const override { return _base.indices().size(); }
          virtual const std::string& type_name() const override { return BaseIndex_name; }
          virtual std::pair<int64_t, int64_t> undo_stack_revision_range()const override { return _base.undo_stack_revision_range(); }
 
          virtual void     remove_object( int64_t id ) override { return _base.remove_object( id ); }
+         virtual void     copy_into( abstract_index& dest )const override { _base.copy_into( *static_cast<BaseIndex*>( dest.get() ) ); }
+         virtual undo_index_memory_stats memory_stats()const override { return _base.memory_stats(); }
       private:
          BaseIndex& _base;
          std::string BaseIndex_name = boost::core::demangle( typeid( typename BaseIndex::value_type ).name() );
@@ -213,6 +197,130 @@ namespace chainbase {
    };
 
 
+   /**
+    * An undo session of every index of a database. Starting one only increments the revision, and the
+    * indices written in it push their undo state lazily, so a session is just the database it belongs to.
+    * Sessions must be undone, squashed or pushed in the reverse order they were started.
+    */
+   template<typename Database>
+   class undo_session {
+      public:
+         undo_session( undo_session&& s ):_db( s._db ){ s._db = nullptr; }
+         undo_session& operator=( undo_session&& s ) {
+            if( this != &s ) {
+               undo();
+               _db = s._db;
+               s._db = nullptr;
+            }
+            return *this;
+         }
+
+         // Undo leaves the database unchanged when it throws, which it only does when an index written in the
+         // session has not been added, so the session is then left in place rather than terminating
+         ~undo_session() {
+            try {
+               undo();
+            } catch( const std::exception& e ) {
+               std::cerr << "CHAINBASE: ERROR: could not undo a session: " << e.what() << std::endl;
+            }
+         }
+
+         void push()
+         {
+            _db = nullptr;
+         }
+
+         void squash()
+         {
+            if( _db ) _db->squash();
+            _db = nullptr;
+         }
+
+         void undo()
+         {
+            if( _db ) _db->undo();
+            _db = nullptr;
+         }
+
+      private:
+         friend Database;
+         undo_session(){}
+         explicit undo_session( Database& db ):_db( &db ){}
+
+         Database* _db = nullptr;
+   };
+
+   /**
+    * Finds the undo_clock shared by the indices in the segment, creating it unless the database is read only
+    */
+   inline undo_clock* open_undo_clock( pinnable_mapped_file& db_file, bool read_only ) {
+      undo_clock* clock = nullptr;
+      if( read_only )
+         clock = db_file.get_segment_manager()->find_no_lock< undo_clock >( "undo_clock" ).first;
+      else
+         clock = db_file.get_segment_manager()->find_or_construct< undo_clock >( "undo_clock" )();
+      if( !clock )
+         BOOST_THROW_EXCEPTION( std::runtime_error( "unable to find the undo clock in read only database" ) );
+      return clock;
+   }
+
+   /**
+    * Finds an index in the segment, creating it unless the database is read only, and makes it share the
+    * revision and undo sessions of clock. An index that is new while there are undo sessions simply has no
+    * changes in them.
+    */
+   template<typename MultiIndexType>
+   generic_index<MultiIndexType>* open_index( pinnable_mapped_file& db_file, bool read_only, undo_clock& clock ) {
+      const uint16_t type_id = generic_index<MultiIndexType>::value_type::type_id;
+      typedef generic_index<MultiIndexType>          index_type;
+      typedef typename index_type::allocator_type    index_alloc;
+
+      std::string type_name = boost::core::demangle( typeid( typename index_type::value_type ).name() );
+
+      if( index_type::max_segment_size && db_file.get_max_size() > index_type::max_segment_size ) {
+         BOOST_THROW_EXCEPTION( std::logic_error( type_name + " uses compact hooks, which require a database smaller than " +
+                                                  std::to_string(index_type::max_segment_size) + " bytes" ) );
+      }
+
+      index_type* idx_ptr = nullptr;
+      if( read_only )
+         idx_ptr = db_file.get_segment_manager()->find_no_lock< index_type >( type_name.c_str() ).first;
+      else
+         idx_ptr = db_file.get_segment_manager()->find< index_type >( type_name.c_str() ).first;
+      bool first_time_adding = false;
+      if( !idx_ptr ) {
+         if( read_only ) {
+            BOOST_THROW_EXCEPTION( std::runtime_error( "unable to find index for " + type_name + " in read only database" ) );
+         }
+         first_time_adding = true;
+         idx_ptr = db_file.get_segment_manager()->construct< index_type >( type_name.c_str() )( index_alloc( db_file.get_segment_manager() ) );
+      }
+
+      idx_ptr->validate();
+
+      if( !idx_ptr->uses_clock( clock ) ) {
+         auto added_index_revision_range = idx_ptr->undo_stack_revision_range();
+         if( added_index_revision_range.first != added_index_revision_range.second ) {
+            BOOST_THROW_EXCEPTION( std::logic_error(
+               "existing index for " + type_name + " has an undo stack (revision range [" +
+               std::to_string(added_index_revision_range.first) + ", " + std::to_string(added_index_revision_range.second) +
+               "]) that is not shared with other indices in the database (revision range [" +
+               std::to_string(clock.first) + ", " + std::to_string(clock.revision) +
+               "]); corrupted database?"
+            ) );
+         }
+         if( read_only ) {
+            BOOST_THROW_EXCEPTION( std::logic_error(
+               "index for " + type_name + " must share the undo stack of the other indices in the database; cannot fix in read-only mode"
+            ) );
+         }
+         if( !first_time_adding && !clock.has_session() && added_index_revision_range.second > clock.revision )
+            clock.revision = clock.first = added_index_revision_range.second;
+         idx_ptr->attach_clock( clock, type_id );
+      }
+      return idx_ptr;
+   }
+
    class read_write_mutex_manager
    {
       public:
@@ -245,10 +353,247 @@ namespace chainbase {
    };
 
 
+   /**
+    * What database and static_database have in common: the segment, the undo clock and the object accessors.
+    * Derived provides get_index and get_mutable_index, and with_touched_index( touch, f ), which calls f with
+    * the index that owns an undo_state linked to the clock or throws std::logic_error when it has none. It
+    * also provides queue_reclaim( idx ), called for each index that commit leaves records to free in, and
+    * reclaim_undo( max_records ).
+    */
+   template<typename Derived>
+   class database_base
+   {
+      public:
+         bool is_read_only() const { return _read_only; }
+         std::future<void> flush() { return _db_file.flush(); }
+
+         int64_t revision()const {
+             if( !_clock ) return -1;
+             return _clock->revision;
+         }
+
+         // An index that has not been added in this process can't be undone, squashed or committed, so every
+         // index involved is looked up before anything changes
+         void undo()
+         {
+            if( !_clock || !_clock->has_session() )
+               return;
+            _clock->for_each_current( [this]( const undo_touch& touch ) { derived().with_touched_index( touch, []( auto& ) {} ); } );
+            _clock->undo( [this]( const undo_touch& touch ) {
+               derived().with_touched_index( touch, []( auto& idx ) { idx.undo_touched(); } );
+            } );
+         }
+
+         void squash()
+         {
+            if( !_clock || !_clock->has_session() )
+               return;
+            _clock->for_each_current( [this]( const undo_touch& touch ) { derived().with_touched_index( touch, []( auto& ) {} ); } );
+            _clock->squash( [this]( const undo_touch& touch ) {
+               derived().with_touched_index( touch, []( auto& idx ) { idx.squash_touched(); } );
+            } );
+         }
+
+         // Committing only detaches what the sessions saved, which is then freed in slices by reclaim_undo
+         void commit( int64_t revision )
+         {
+            if( !_clock )
+               return;
+            _clock->for_each_committed( revision, [this]( const undo_touch& touch ) { derived().with_touched_index( touch, []( auto& ) {} ); } );
+            _clock->commit( revision, [this]( const undo_touch& touch, int64_t revision ) {
+               derived().with_touched_index( touch, [this, revision]( auto& idx ) {
+                  idx.commit_undo_states( revision );
+                  derived().queue_reclaim( idx );
+               } );
+            } );
+            derived().reclaim_undo( _undo_reclaim_slice );
+         }
+
+         void undo_all()
+         {
+            while( _clock && _clock->has_session() )
+               derived().undo();
+         }
+
+         /**
+          * Frees everything that committed sessions saved for undo, for example before shutdown or shrink_to_fit()
+          */
+         void drain_undo() { derived().reclaim_undo( std::numeric_limits<size_t>::max() ); }
+
+         void set_undo_reclaim_slice( size_t max_records ) { _undo_reclaim_slice = max_records; }
+
+         auto get_segment_manager() {
+            return _db_file.get_segment_manager();
+         }
+
+         auto get_segment_manager()const -> std::add_const_t< decltype( std::declval<pinnable_mapped_file&>().get_segment_manager() ) > {
+            return _db_file.get_segment_manager();
+         }
+
+         size_t get_free_memory()const
+         {
+            return _db_file.get_segment_manager()->get_free_memory();
+         }
+
+         pinnable_mapped_file::segment_stats get_segment_stats()const
+         {
+            return _db_file.get_segment_stats();
+         }
+
+         template< typename ObjectType, typename IndexedByType, typename CompatibleKey >
+         const ObjectType* find( CompatibleKey&& key )const
+         {
+             typedef typename get_index_type< ObjectType >::type index_type;
+             const auto& idx = derived().template get_index< index_type >().indices().template get< IndexedByType >();
+             auto itr = idx.find( std::forward< CompatibleKey >( key ) );
+             if( itr == idx.end() ) return nullptr;
+             return &*itr;
+         }
+
+         template< typename ObjectType >
+         const ObjectType* find( oid< ObjectType > key = oid< ObjectType >() ) const
+         {
+             typedef typename get_index_type< ObjectType >::type index_type;
+             return derived().template get_index< index_type >().find( key );
+         }
+
+         template< typename ObjectType, typename IndexedByType, typename CompatibleKey >
+         const ObjectType& get( CompatibleKey&& key )const
+         {
+             auto obj = find< ObjectType, IndexedByType >( std::forward< CompatibleKey >( key ) );
+             if( !obj ) {
+                std::stringstream ss;
+                ss << "unknown key (" << boost::core::demangle( typeid( key ).name() ) << "): " << key;
+                BOOST_THROW_EXCEPTION( std::out_of_range( ss.str().c_str() ) );
+             }
+             return *obj;
+         }
+
+         template< typename ObjectType >
+         const ObjectType& get( const oid< ObjectType >& key = oid< ObjectType >() )const
+         {
+             auto obj = find< ObjectType >( key );
+             if( !obj ) {
+                std::stringstream ss;
+                ss << "unknown key (" << boost::core::demangle( typeid( key ).name() ) << "): " << key._id;
+                BOOST_THROW_EXCEPTION( std::out_of_range( ss.str().c_str() ) );
+             }
+             return *obj;
+         }
+
+         /**
+          * Saving the object for undo allocates, so like create, modify grows the database first when it is
+          * short of free space.
+          */
+         template<typename ObjectType, typename Modifier>
+         void modify( const ObjectType& obj, Modifier&& m )
+         {
+             typedef typename get_index_type<ObjectType>::type index_type;
+             _db_file.grow_if_needed();
+             derived().template get_mutable_index<index_type>().modify( obj, m );
+         }
+
+         /**
+          * Like modify, but undo only saves the given members, or the bytes that the modifier changed when
+          * no members are given, instead of a copy of the whole object.
+          */
+         template<typename ObjectType, typename Modifier, typename... Fields>
+         void modify_fields( const ObjectType& obj, Modifier&& m, Fields... fields )
+         {
+             typedef typename get_index_type<ObjectType>::type index_type;
+             _db_file.grow_if_needed();
+             derived().template get_mutable_index<index_type>().modify_fields( obj, m, fields... );
+         }
+
+         /**
+          * Like modify, for modifiers that only change fields that no index uses as a key, such as
+          * balances. Skips repositioning the object in its indices.
+          */
+         template<typename ObjectType, typename Modifier>
+         void modify_nonkey( const ObjectType& obj, Modifier&& m )
+         {
+             typedef typename get_index_type<ObjectType>::type index_type;
+             _db_file.grow_if_needed();
+             derived().template get_mutable_index<index_type>().modify_nonkey( obj, m );
+         }
+
+         template<typename ObjectType>
+         void remove( const ObjectType& obj )
+         {
+             typedef typename get_index_type<ObjectType>::type index_type;
+             _db_file.grow_if_needed();
+             return derived().template get_mutable_index<index_type>().remove( obj );
+         }
+
+         template<typename ObjectType, typename Constructor>
+         const ObjectType& create( Constructor&& con )
+         {
+             typedef typename get_index_type<ObjectType>::type index_type;
+             // Room is made before the constructor runs, so it runs once. Whatever it allocates itself has to fit
+             // in the auto grow increment that is left free; if it doesn't, bip::bad_alloc leaves nothing created.
+             _db_file.grow_if_needed( sizeof( ObjectType ) );
+             return derived().template get_mutable_index<index_type>().emplace( std::forward<Constructor>(con) );
+         }
+
+         /**
+          * Creates an object for each constructor in the range, building the indices from sorted objects
+          * rather than inserting them one at a time. Meant for loading a snapshot or the initial state, so
+          * there must not be an undo session.
+          */
+         template<typename ObjectType, typename Constructors>
+         void bulk_load( Constructors&& constructors )
+         {
+             typedef typename get_index_type<ObjectType>::type index_type;
+             if constexpr( !is_forward_range<Constructors> ) {
+                // A single pass range is read into memory so that its size is known
+                std::vector<std::decay_t<decltype( *std::begin( constructors ) )>> buffered( std::begin( constructors ), std::end( constructors ) );
+                bulk_load<ObjectType>( buffered );
+             } else {
+                // Grown once up front so that every constructor runs once: the nodes, and a pointer or two more per
+                // object for id directories and hash buckets
+                const size_t count = std::distance( std::begin( constructors ), std::end( constructors ) );
+                _db_file.grow_if_needed( count * ( sizeof( typename generic_index<index_type>::node ) + 2*sizeof( void* ) ) );
+                derived().template get_mutable_index<index_type>().bulk_load( std::forward<Constructors>( constructors ) );
+             }
+         }
+
+      protected:
+         database_base( const bfs::path& dir, bool writable, uint64_t shared_file_size, bool allow_dirty,
+                        pinnable_mapped_file::map_mode db_map_mode, std::vector<std::string> hugepage_paths, unsigned io_threads,
+                        bool transparent_huge_pages, pinnable_mapped_file::auto_grow_policy auto_grow ) :
+            _db_file(dir, writable, shared_file_size, allow_dirty, db_map_mode, hugepage_paths, io_threads, transparent_huge_pages,
+                     auto_grow),
+            _read_only(!writable)
+         {
+         }
+
+         Derived& derived() { return static_cast<Derived&>( *this ); }
+         const Derived& derived()const { return static_cast<const Derived&>( *this ); }
+
+         // The clock that indices are opened with, found or created on first use
+         undo_clock& open_clock()
+         {
+            if( !_clock )
+               _clock = open_undo_clock( _db_file, _read_only );
+            return *_clock;
+         }
+
+         pinnable_mapped_file                                        _db_file;
+         bool                                                        _read_only = false;
+
+         /**
+          * The revision and undo sessions of every index, in the segment
+          */
+         undo_clock*                                                 _clock = nullptr;
+
+         // How many records commit frees
+         size_t                                                      _undo_reclaim_slice = 4096;
+   };
+
    /**
     *  This class
     */
-   class database
+   class database : public database_base<database>
    {
       public:
          enum open_flags {
@@ -260,12 +605,22 @@ namespace chainbase {
 
          database(const bfs::path& dir, open_flags write = read_only, uint64_t shared_file_size = 0, bool allow_dirty = false,
                   pinnable_mapped_file::map_mode = pinnable_mapped_file::map_mode::mapped,
-                  std::vector<std::string> hugepage_paths = std::vector<std::string>());
+                  std::vector<std::string> hugepage_paths = std::vector<std::string>(), unsigned io_threads = 0,
+                  bool transparent_huge_pages = false,
+                  pinnable_mapped_file::auto_grow_policy auto_grow = pinnable_mapped_file::auto_grow_policy());
          ~database();
          database(database&&) = default;
          database& operator=(database&&) = default;
-         bool is_read_only() const { return _read_only; }
-         void flush();
+         size_t transparent_huge_page_bytes() const { return _db_file.transparent_huge_page_bytes(); }
+
+         /**
+          * Copies every index into dest, which must have the same indices added and hold no objects, and
+          * neither database may have an undo stack. Copying into a freshly created database and then calling
+          * shrink_to_fit() on it compacts a fragmented database. A dest with an auto grow policy grows as needed,
+          * so it can start small.
+          */
+         void copy_into( database& dest )const;
+         size_t shrink_to_fit() { drain_undo(); return _db_file.shrink_to_fit(); }
          void set_require_locking( bool enable_require_locking );
 
 #ifdef CHAINBASE_CHECK_LOCKING
@@ -284,53 +639,33 @@ namespace chainbase {
          }
 #endif
 
-         struct session {
-            public:
-               session( session&& s ):_index_sessions( std::move(s._index_sessions) ){}
-               session( vector<std::unique_ptr<abstract_session>>&& s ):_index_sessions( std::move(s) )
-               {
-               }
-
-               ~session() {
-                  undo();
-               }
-
-               void push()
-               {
-                  for( auto& i : _index_sessions ) i->push();
-                  _index_sessions.clear();
-               }
-
-               void squash()
-               {
-                  for( auto& i : _index_sessions ) i->squash();
-                  _index_sessions.clear();
-               }
-
-               void undo()
-               {
-                  for( auto& i : _index_sessions ) i->undo();
-                  _index_sessions.clear();
-               }
-
-            private:
-               friend class database;
-               session(){}
-
-               vector< std::unique_ptr<abstract_session> > _index_sessions;
-         };
+         using session = undo_session<database>;
 
          session start_undo_session( bool enabled );
 
-         int64_t revision()const {
-             if( _index_list.size() == 0 ) return -1;
-             return _index_list[0]->revision();
-         }
-
          void undo();
          void squash();
-         void commit( int64_t revision );
-         void undo_all();
+
+         /**
+          * Runs task(i) for every i < count, possibly concurrently, and returns once all of them have finished
+          */
+         using undo_executor = std::function<void( size_t count, const std::function<void( size_t )>& task )>;
+
+         /**
+          * Lets undo and squash process the indices written in a session concurrently on executor.
+          * Indices with fewer than min_parallel_records objects saved for undo are processed on the calling
+          * thread, since handing them off costs more than it saves. An empty executor processes every index
+          * on the calling thread, which is the default.
+          */
+         void set_undo_executor( undo_executor executor, size_t min_parallel_records = 1024 );
+
+         /**
+          * Frees up to max_records of the objects that committed sessions saved for undo, and returns the
+          * number freed. commit only detaches them and frees up to the slice set by set_undo_reclaim_slice,
+          * so that committing many sessions at once does not stall; call this when idle to free the rest.
+          */
+         size_t reclaim_undo( size_t max_records );
+
 
 
          void set_revision( uint64_t revision )
@@ -344,61 +679,13 @@ namespace chainbase {
          void add_index() {
             const uint16_t type_id = generic_index<MultiIndexType>::value_type::type_id;
             typedef generic_index<MultiIndexType>          index_type;
-            typedef typename index_type::allocator_type    index_alloc;
-
-            std::string type_name = boost::core::demangle( typeid( typename index_type::value_type ).name() );
 
             if( !( _index_map.size() <= type_id || _index_map[ type_id ] == nullptr ) ) {
+               std::string type_name = boost::core::demangle( typeid( typename index_type::value_type ).name() );
                BOOST_THROW_EXCEPTION( std::logic_error( type_name + "::type_id is already in use" ) );
             }
 
-            index_type* idx_ptr = nullptr;
-            if( _read_only )
-               idx_ptr = _db_file.get_segment_manager()->find_no_lock< index_type >( type_name.c_str() ).first;
-            else
-               idx_ptr = _db_file.get_segment_manager()->find< index_type >( type_name.c_str() ).first;
-            bool first_time_adding = false;
-            if( !idx_ptr ) {
-               if( _read_only ) {
-                  BOOST_THROW_EXCEPTION( std::runtime_error( "unable to find index for " + type_name + " in read only database" ) );
-               }
-               first_time_adding = true;
-               idx_ptr = _db_file.get_segment_manager()->construct< index_type >( type_name.c_str() )( index_alloc( _db_file.get_segment_manager() ) );
-             }
-
-            idx_ptr->validate();
-
-            // Ensure the undo stack of added index is consistent with the other indices in the database
-            if( _index_list.size() > 0 ) {
-               auto expected_revision_range = _index_list.front()->undo_stack_revision_range();
-               auto added_index_revision_range = idx_ptr->undo_stack_revision_range();
-
-               if( added_index_revision_range.first != expected_revision_range.first ||
-                   added_index_revision_range.second != expected_revision_range.second ) {
-
-                  if( !first_time_adding ) {
-                     BOOST_THROW_EXCEPTION( std::logic_error(
-                        "existing index for " + type_name + " has an undo stack (revision range [" +
-                        std::to_string(added_index_revision_range.first) + ", " + std::to_string(added_index_revision_range.second) +
-                        "]) that is inconsistent with other indices in the database (revision range [" +
-                        std::to_string(expected_revision_range.first) + ", " + std::to_string(expected_revision_range.second) +
-                        "]); corrupted database?"
-                     ) );
-                  }
-
-                  if( _read_only ) {
-                     BOOST_THROW_EXCEPTION( std::logic_error(
-                        "new index for " + type_name +
-                        " requires an undo stack that is consistent with other indices in the database; cannot fix in read-only mode"
-                     ) );
-                  }
-
-                  idx_ptr->set_revision( static_cast<uint64_t>(expected_revision_range.first) );
-                  while( idx_ptr->revision() < expected_revision_range.second ) {
-                     idx_ptr->start_undo_session(true).push();
-                  }
-               }
-            }
+            index_type* idx_ptr = open_index<MultiIndexType>( _db_file, _read_only, open_clock() );
 
             if( type_id >= _index_map.size() )
                _index_map.resize( type_id + 1 );
@@ -406,19 +693,38 @@ namespace chainbase {
             auto new_index = new index<index_type>( *idx_ptr );
             _index_map[ type_id ].reset( new_index );
             _index_list.push_back( new_index );
+            // It may have records left from commits before the database was last closed
+            queue_reclaim( *new_index );
          }
 
-         auto get_segment_manager() -> decltype( ((pinnable_mapped_file*)nullptr)->get_segment_manager()) {
-            return _db_file.get_segment_manager();
+         /**
+          * Reserves a contiguous part of the segment for the objects of an index. Nodes come from the arena
+          * until it fills up. The arena can then be passed to madvise() or mlock() or measured with
+          * resident_bytes() on its own.
+          */
+         template<typename MultiIndexType>
+         void reserve_index_arena( size_t bytes )
+         {
+            get_mutable_index<MultiIndexType>().reserve_arena( bytes );
          }
 
-         auto get_segment_manager()const -> std::add_const_t< decltype( ((pinnable_mapped_file*)nullptr)->get_segment_manager() ) > {
-            return _db_file.get_segment_manager();
+         template<typename MultiIndexType>
+         std::pair<const char*, size_t> get_index_arena()const
+         {
+            return get_index<MultiIndexType>().arena();
          }
 
-         size_t get_free_memory()const
+         size_t resident_bytes( const void* addr, size_t size )const
          {
-            return _db_file.get_segment_manager()->get_free_memory();
+            return _db_file.resident_bytes( addr, size );
+         }
+
+         std::map<std::string, undo_index_memory_stats> memory_stats_per_index()const
+         {
+            std::map<std::string, undo_index_memory_stats> ret;
+            for( const auto& ai_ptr : _index_list )
+               ret.emplace( ai_ptr->type_name(), ai_ptr->memory_stats() );
+            return ret;
          }
 
          template<typename MultiIndexType>
@@ -454,75 +760,6 @@ namespace chainbase {
             return *index_type_ptr( _index_map[index_type::value_type::type_id]->get() );
          }
 
-         template< typename ObjectType, typename IndexedByType, typename CompatibleKey >
-         const ObjectType* find( CompatibleKey&& key )const
-         {
-             CHAINBASE_REQUIRE_READ_LOCK("find", ObjectType);
-             typedef typename get_index_type< ObjectType >::type index_type;
-             const auto& idx = get_index< index_type >().indices().template get< IndexedByType >();
-             auto itr = idx.find( std::forward< CompatibleKey >( key ) );
-             if( itr == idx.end() ) return nullptr;
-             return &*itr;
-         }
-
-         template< typename ObjectType >
-         const ObjectType* find( oid< ObjectType > key = oid< ObjectType >() ) const
-         {
-             CHAINBASE_REQUIRE_READ_LOCK("find", ObjectType);
-             typedef typename get_index_type< ObjectType >::type index_type;
-             return get_index< index_type >().find( key );
-         }
-
-         template< typename ObjectType, typename IndexedByType, typename CompatibleKey >
-         const ObjectType& get( CompatibleKey&& key )const
-         {
-             CHAINBASE_REQUIRE_READ_LOCK("get", ObjectType);
-             auto obj = find< ObjectType, IndexedByType >( std::forward< CompatibleKey >( key ) );
-             if( !obj ) {
-                std::stringstream ss;
-                ss << "unknown key (" << boost::core::demangle( typeid( key ).name() ) << "): " << key;
-                BOOST_THROW_EXCEPTION( std::out_of_range( ss.str().c_str() ) );
-             }
-             return *obj;
-         }
-
-         template< typename ObjectType >
-         const ObjectType& get( const oid< ObjectType >& key = oid< ObjectType >() )const
-         {
-             CHAINBASE_REQUIRE_READ_LOCK("get", ObjectType);
-             auto obj = find< ObjectType >( key );
-             if( !obj ) {
-                std::stringstream ss;
-                ss << "unknown key (" << boost::core::demangle( typeid( key ).name() ) << "): " << key._id;
-                BOOST_THROW_EXCEPTION( std::out_of_range( ss.str().c_str() ) );
-             }
-             return *obj;
-         }
-
-         template<typename ObjectType, typename Modifier>
-         void modify( const ObjectType& obj, Modifier&& m )
-         {
-             CHAINBASE_REQUIRE_WRITE_LOCK("modify", ObjectType);
-             typedef typename get_index_type<ObjectType>::type index_type;
-             get_mutable_index<index_type>().modify( obj, m );
-         }
-
-         template<typename ObjectType>
-         void remove( const ObjectType& obj )
-         {
-             CHAINBASE_REQUIRE_WRITE_LOCK("remove", ObjectType);
-             typedef typename get_index_type<ObjectType>::type index_type;
-             return get_mutable_index<index_type>().remove( obj );
-         }
-
-         template<typename ObjectType, typename Constructor>
-         const ObjectType& create( Constructor&& con )
-         {
-             CHAINBASE_REQUIRE_WRITE_LOCK("create", ObjectType);
-             typedef typename get_index_type<ObjectType>::type index_type;
-             return get_mutable_index<index_type>().emplace( std::forward<Constructor>(con) );
-         }
-
          database_index_row_count_multiset row_count_per_index()const {
             database_index_row_count_multiset ret;
             for(const auto& ai_ptr : _index_map) {
@@ -534,11 +771,10 @@ namespace chainbase {
          }
 
       private:
-         pinnable_mapped_file                                        _db_file;
-         bool                                                        _read_only = false;
+         friend class database_base<database>;
 
          /**
-          * This is a sparse list of known indices kept to accelerate creation of undo sessions
+          * This is a sparse list of known indices kept to accelerate iterating over them
           */
          vector<abstract_index*>                                     _index_list;
 
@@ -547,6 +783,32 @@ namespace chainbase {
           */
          vector<unique_ptr<abstract_index>>                          _index_map;
 
+         // The index that owns an undo_state linked to the clock
+         abstract_index& touched_index( const undo_touch& touch )const;
+
+         template<typename F>
+         void with_touched_index( const undo_touch& touch, F&& f ) { f( touched_index( touch ) ); }
+
+         // Runs op( i ) for each of _touched_indices, with the larger ones on the executor
+         template<typename Op>
+         void run_touched( Op&& op );
+
+         undo_executor                                               _undo_executor;
+         size_t                                                      _min_parallel_records = 0;
+         // Scratch space of undo and squash with an executor
+         vector<undo_touch*>                                         _touches;
+         vector<abstract_index*>                                     _touched_indices;
+         vector<size_t>                                              _parallel_indices;
+         vector<char>                                                _relabeled;
+
+         // Indices that may have committed undo records left to free
+         vector<abstract_index*>                                     _reclaim_queue;
+
+         void queue_reclaim( abstract_index& idx ) {
+            if( std::find( _reclaim_queue.begin(), _reclaim_queue.end(), &idx ) == _reclaim_queue.end() )
+               _reclaim_queue.push_back( &idx );
+         }
+
 #ifdef CHAINBASE_CHECK_LOCKING
          int32_t                                                     _read_lock_count = 0;
          int32_t                                                     _write_lock_count = 0;
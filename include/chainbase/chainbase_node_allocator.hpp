@@ -1,7 +1,11 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
 #include <boost/interprocess/offset_ptr.hpp>
+#include <boost/throw_exception.hpp>
 
 #include <chainbase/pinnable_mapped_file.hpp>
 
@@ -9,6 +13,30 @@ namespace chainbase {
 
    namespace bip = boost::interprocess;
 
+   // Node allocators carve nodes out of chunks aligned to a page, so that the chunk of a node is found by masking
+   // its address. A chunk is sized so that with the header the segment manager puts in front of each allocation it
+   // takes up exactly one page, and consecutive chunks pack back to back.
+   constexpr std::size_t allocator_chunk_alignment = 4096;
+   constexpr std::size_t allocator_chunk_size = [] {
+      using memory_algorithm = pinnable_mapped_file::segment_manager::memory_algorithm;
+      // The header of an allocated block: its payload overhead plus the size field that overlaps the previous block
+      constexpr std::size_t header = memory_algorithm::PayloadPerAllocation + sizeof(memory_algorithm::size_type);
+      static_assert(header % memory_algorithm::Alignment == 0 && allocator_chunk_alignment % memory_algorithm::Alignment == 0,
+                    "allocated blocks of the segment manager no longer pack into pages");
+      static_assert(header < allocator_chunk_alignment / 16, "the segment manager's block header is too large for chunks");
+      return allocator_chunk_alignment - header;
+   }();
+
+   // Slab allocator for single nodes. Nodes are carved out of page aligned chunks that track how many of their nodes
+   // are in use, so that a chunk can be handed back to the segment manager once all of its nodes are freed. Chunks
+   // with free nodes are kept on a list that puts chunks that were full most recently in front, so allocation keeps
+   // filling the fullest chunks while sparse ones get a chance to drain.
+   //
+   // Chunks are at most a page so that their alignment holds wherever the segment is mapped; the chunk of a node is
+   // found by masking its address. Nodes too large to fit several to a page are allocated individually.
+   //
+   // An allocator may reserve an arena, a contiguous part of the segment that its chunks are taken from before
+   // falling back to the rest of the segment. Chunks freed within the arena stay with it.
    template<typename T, typename S>
    class chainbase_node_allocator {
     public:
@@ -20,21 +48,37 @@ namespace chainbase {
       template<typename U>
       chainbase_node_allocator(const chainbase_node_allocator<U, S>& other) : _manager(other._manager) {}
       pointer allocate(std::size_t num) {
-         if (num == 1) {
-            if (_freelist == nullptr) {
+         if (num == 1 && use_chunks) {
+            if (_partial == nullptr) {
                get_some();
             }
-            list_item* result = &*_freelist;
-            _freelist = _freelist->_next;
+            chunk_header* chunk = &*_partial;
+            list_item* result = &*chunk->_freelist;
+            chunk->_freelist = result->_next;
             result->~list_item();
+            if (++chunk->_used == nodes_per_chunk) {
+               unlink(chunk);
+            }
+            --_freelist_size;
             return pointer{(T*)result};
          } else {
             return pointer{(T*)_manager->allocate(num*sizeof(T))};
          }
       }
       void deallocate(const pointer& p, std::size_t num) {
-         if (num == 1) {
-            _freelist = new (&*p) list_item{_freelist};
+         if (num == 1 && use_chunks) {
+            chunk_header* chunk = chunk_of(&*p);
+            chunk->_freelist = new (&*p) list_item{chunk->_freelist};
+            ++_freelist_size;
+            if (chunk->_used-- == nodes_per_chunk) {
+               push_front(chunk);
+            } else if (chunk->_used == 0 && (chunk->_prev != nullptr || chunk->_next != nullptr)) {
+               // Keep a lone empty chunk around so that alternating allocate/deallocate doesn't hit the segment manager
+               unlink(chunk);
+               _freelist_size -= nodes_per_chunk;
+               chunk->~chunk_header();
+               release_chunk(chunk);
+            }
          } else {
             _manager->deallocate(&*p);
          }
@@ -42,24 +86,207 @@ namespace chainbase {
       bool operator==(const chainbase_node_allocator& other) const { return this == &other; }
       bool operator!=(const chainbase_node_allocator& other) const { return this != &other; }
       segment_manager* get_segment_manager() const { return _manager.get(); }
+      // Bytes allocated from the segment but currently unused
+      std::size_t freelist_bytes() const { return _freelist_size * node_size; }
+
+      void reserve_arena(std::size_t bytes) {
+         if (_arena_begin != nullptr)
+            BOOST_THROW_EXCEPTION(std::logic_error("an arena has already been reserved"));
+         if (!use_chunks)
+            return;
+         bytes = align_up(bytes, chunk_alignment);
+         char* base = (char*)_manager->allocate_aligned(bytes, chunk_alignment);
+         _arena_begin = base;
+         _arena_next = base;
+         _arena_end = base + bytes;
+      }
+      // The reserved arena, if any, as a pointer and a size
+      std::pair<const char*, std::size_t> arena() const {
+         return { _arena_begin.get(), _arena_end.get() - _arena_begin.get() };
+      }
     private:
       template<typename T2, typename S2>
       friend class chainbase_node_allocator;
+      struct list_item { bip::offset_ptr<list_item> _next; };
+      struct chunk_header {
+         bip::offset_ptr<chunk_header> _prev;
+         bip::offset_ptr<chunk_header> _next;
+         bip::offset_ptr<list_item>    _freelist;
+         std::uint32_t                 _used = 0;
+      };
+
+      static constexpr std::size_t align_up(std::size_t n, std::size_t a) { return (n + a - 1) / a * a; }
+      static constexpr std::size_t chunk_alignment = allocator_chunk_alignment;
+      static constexpr std::size_t chunk_size = allocator_chunk_size;
+      static constexpr std::size_t node_alignment = alignof(T) > alignof(list_item) ? alignof(T) : alignof(list_item);
+      static constexpr std::size_t node_size = align_up(sizeof(T) > sizeof(list_item) ? sizeof(T) : sizeof(list_item), node_alignment);
+      static constexpr std::size_t first_node_offset = align_up(sizeof(chunk_header), node_alignment);
+      static constexpr std::size_t nodes_per_chunk = (chunk_size - first_node_offset) / node_size;
+      static constexpr bool use_chunks = nodes_per_chunk >= 4;
+
+      static chunk_header* chunk_of(void* node) {
+         return (chunk_header*)((std::uintptr_t)node & ~(std::uintptr_t)(chunk_alignment - 1));
+      }
+      void push_front(chunk_header* chunk) {
+         chunk->_prev = nullptr;
+         chunk->_next = _partial;
+         if (_partial != nullptr) {
+            _partial->_prev = chunk;
+         }
+         _partial = chunk;
+      }
+      void unlink(chunk_header* chunk) {
+         if (chunk->_prev != nullptr) {
+            chunk->_prev->_next = chunk->_next;
+         } else {
+            _partial = chunk->_next;
+         }
+         if (chunk->_next != nullptr) {
+            chunk->_next->_prev = chunk->_prev;
+         }
+         chunk->_prev = nullptr;
+         chunk->_next = nullptr;
+      }
+      char* take_chunk() {
+         if (_arena_free != nullptr) {
+            free_chunk* result = &*_arena_free;
+            _arena_free = result->_next;
+            result->~free_chunk();
+            return (char*)result;
+         }
+         if (_arena_next != _arena_end) {
+            char* result = &*_arena_next;
+            _arena_next += chunk_alignment;
+            return result;
+         }
+         return (char*)_manager->allocate_aligned(chunk_size, chunk_alignment);
+      }
+      void release_chunk(void* chunk) {
+         if (chunk >= _arena_begin.get() && chunk < _arena_end.get()) {
+            _arena_free = new (chunk) free_chunk{_arena_free};
+         } else {
+            _manager->deallocate(chunk);
+         }
+      }
       void get_some() {
-         static_assert(sizeof(T) >= sizeof(list_item), "Too small for free list");
-         static_assert(sizeof(T) % alignof(list_item) == 0, "Bad alignment for free list");
-         char* result = (char*)_manager->allocate(sizeof(T) * 64);
-         _freelist = bip::offset_ptr<list_item>{(list_item*)result};
-         for(int i = 0; i < 63; ++i) {
-            char* next = result + sizeof(T);
+         char* base = take_chunk();
+         chunk_header* chunk = new (base) chunk_header;
+         char* result = base + first_node_offset;
+         chunk->_freelist = bip::offset_ptr<list_item>{(list_item*)result};
+         for(std::size_t i = 0; i < nodes_per_chunk - 1; ++i) {
+            char* next = result + node_size;
             new(result) list_item{bip::offset_ptr<list_item>{(list_item*)next}};
             result = next;
          }
          new(result) list_item{nullptr};
+         _freelist_size += nodes_per_chunk;
+         push_front(chunk);
+      }
+      bip::offset_ptr<pinnable_mapped_file::segment_manager> _manager;
+      struct free_chunk { bip::offset_ptr<free_chunk> _next; };
+      bip::offset_ptr<chunk_header> _partial{};
+      std::size_t _freelist_size = 0;
+      bip::offset_ptr<char> _arena_begin{};
+      bip::offset_ptr<char> _arena_next{};
+      bip::offset_ptr<char> _arena_end{};
+      bip::offset_ptr<free_chunk> _arena_free{};
+   };
+
+   // Bump allocator for undo records.  Records are created and freed roughly in the order of their undo sessions,
+   // so rather than reusing freed slots, nodes are carved in order out of the current chunk, and a chunk is
+   // handed back once all of its nodes are freed.  The records of consecutive sessions end up in the same
+   // chunks, which empty out together as sessions are undone or committed.  The current chunk starts over
+   // when all of its nodes are freed, and one empty chunk is kept for the next one.
+   template<typename T, typename S>
+   class chainbase_record_allocator {
+    public:
+      using value_type = T;
+      using pointer = bip::offset_ptr<T>;
+      using segment_manager = pinnable_mapped_file::segment_manager;
+      chainbase_record_allocator(segment_manager* manager) : _manager{manager} {}
+      chainbase_record_allocator(const chainbase_record_allocator& other) : _manager(other._manager) {}
+      template<typename U>
+      chainbase_record_allocator(const chainbase_record_allocator<U, S>& other) : _manager(other._manager) {}
+      template<typename U>
+      chainbase_record_allocator(const chainbase_node_allocator<U, S>& other) : _manager(other.get_segment_manager()) {}
+      pointer allocate(std::size_t num) {
+         if (num == 1 && use_chunks) {
+            if (_current == nullptr || _next == _current_end) {
+               next_chunk();
+            }
+            char* result = _next.get();
+            _next += node_size;
+            ++_current->_used;
+            return pointer{(T*)result};
+         } else {
+            return pointer{(T*)_manager->allocate(num*sizeof(T))};
+         }
+      }
+      void deallocate(const pointer& p, std::size_t num) {
+         if (num == 1 && use_chunks) {
+            chunk_header* chunk = chunk_of(&*p);
+            if (--chunk->_used == 0) {
+               if (chunk == _current.get()) {
+                  _next = (char*)chunk + first_node_offset;
+               } else {
+                  release_chunk(chunk);
+               }
+            }
+         } else {
+            _manager->deallocate(&*p);
+         }
+      }
+      bool operator==(const chainbase_record_allocator& other) const { return this == &other; }
+      bool operator!=(const chainbase_record_allocator& other) const { return this != &other; }
+      segment_manager* get_segment_manager() const { return _manager.get(); }
+      // Bytes allocated from the segment but not yet handed out
+      std::size_t freelist_bytes() const {
+         return (_current_end.get() - _next.get()) + (_spare != nullptr ? nodes_per_chunk * node_size : 0);
+      }
+    private:
+      template<typename T2, typename S2>
+      friend class chainbase_record_allocator;
+      struct chunk_header {
+         std::uint32_t _used = 0;
+      };
+
+      static constexpr std::size_t align_up(std::size_t n, std::size_t a) { return (n + a - 1) / a * a; }
+      static constexpr std::size_t chunk_alignment = allocator_chunk_alignment;
+      static constexpr std::size_t chunk_size = allocator_chunk_size;
+      static constexpr std::size_t node_size = align_up(sizeof(T), alignof(T));
+      static constexpr std::size_t first_node_offset = align_up(sizeof(chunk_header), alignof(T));
+      static constexpr std::size_t nodes_per_chunk = (chunk_size - first_node_offset) / node_size;
+      static constexpr bool use_chunks = nodes_per_chunk >= 4;
+
+      static chunk_header* chunk_of(void* node) {
+         return (chunk_header*)((std::uintptr_t)node & ~(std::uintptr_t)(chunk_alignment - 1));
+      }
+      void next_chunk() {
+         char* base;
+         if (_spare != nullptr) {
+            base = (char*)_spare.get();
+            _spare = nullptr;
+         } else {
+            base = (char*)_manager->allocate_aligned(chunk_size, chunk_alignment);
+         }
+         // The previous chunk is full, and is released when its last node is freed
+         _current = new (base) chunk_header;
+         _next = base + first_node_offset;
+         _current_end = _next + nodes_per_chunk * node_size;
+      }
+      void release_chunk(chunk_header* chunk) {
+         chunk->~chunk_header();
+         if (_spare == nullptr) {
+            _spare = chunk;
+         } else {
+            _manager->deallocate(chunk);
+         }
       }
-      struct list_item { bip::offset_ptr<list_item> _next; };
       bip::offset_ptr<pinnable_mapped_file::segment_manager> _manager;
-      bip::offset_ptr<list_item> _freelist{};
+      bip::offset_ptr<chunk_header> _current{};
+      bip::offset_ptr<char> _next{};
+      bip::offset_ptr<char> _current_end{};
+      bip::offset_ptr<chunk_header> _spare{};
    };
 
 }  // namepsace chainbase
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <boost/interprocess/offset_ptr.hpp>
+#include <boost/intrusive/parent_from_member.hpp>
+#include <boost/multi_index/hashed_index_fwd.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace chainbase {
+
+   template<typename Index>
+   constexpr bool is_hashed_index = false;
+   template<typename... T>
+   constexpr bool is_hashed_index<boost::multi_index::hashed_unique<T...>> = true;
+
+   // Links an object into a bucket of a hashed index
+   template<typename Index>
+   struct hash_hook {
+      hash_hook() = default;
+      hash_hook(const hash_hook&) {}
+      constexpr hash_hook& operator=(const hash_hook&) { return *this; }
+      boost::interprocess::offset_ptr<hash_hook> _next;
+      std::size_t _hash;
+   };
+
+   // Chained hash table over the nodes of an undo_index, for hashed_unique.  Each object remembers its hash.
+   //
+   // The table doubles when it holds as many objects as buckets.  Rather than moving every object at once, the
+   // objects of the old buckets are moved a few buckets at a time by the following inserts.  Buckets of the old
+   // table below _migrated have been moved.  Old bucket i only feeds new buckets i and i + old size, so those two
+   // are constructed as it is moved and the rest of the new table stays raw memory until then.  Only inserts that
+   // make the index larger than it has ever been can start growing the table, so undo and repositioning a modified
+   // object never allocate.
+   template<typename Node, typename Index>
+   class hash_impl {
+    public:
+      using value_type = typename Node::value_type;
+      using key_from_value_type = typename Index::key_from_value_type;
+      using key_type = std::decay_t<decltype(key_from_value_type{}(std::declval<const value_type&>()))>;
+      using hasher = typename Index::hash_type;
+      using key_equal = typename Index::pred_type;
+
+    private:
+      template<typename T>
+      using offset_ptr = boost::interprocess::offset_ptr<T>;
+      using hook_type = hash_hook<Index>;
+      using bucket_type = offset_ptr<hook_type>;
+      using allocator_type = typename std::allocator_traits<typename Node::allocator_type>::template rebind_alloc<bucket_type>;
+      using alloc_traits = std::allocator_traits<allocator_type>;
+      static constexpr std::size_t initial_buckets = 64;
+      // Old buckets moved by each insert.  At least one is needed to finish before the table fills up again.
+      static constexpr std::size_t migrate_step = 2;
+
+    public:
+      class const_iterator {
+       public:
+         using iterator_category = std::forward_iterator_tag;
+         using value_type = typename hash_impl::value_type;
+         using difference_type = std::ptrdiff_t;
+         using pointer = const value_type*;
+         using reference = const value_type&;
+
+         const_iterator() = default;
+         reference operator*() const { return value_of(*_hook); }
+         pointer operator->() const { return &value_of(*_hook); }
+         const_iterator& operator++() {
+            if(_hook->_next) {
+               _hook = _hook->_next.get();
+            } else {
+               auto [table, i] = _table->bucket_of(_hook->_hash);
+               _hook = _table->first_from(table, i + 1);
+            }
+            return *this;
+         }
+         const_iterator operator++(int) { auto result = *this; ++*this; return result; }
+         friend bool operator==(const const_iterator& lhs, const const_iterator& rhs) { return lhs._hook == rhs._hook; }
+         friend bool operator!=(const const_iterator& lhs, const const_iterator& rhs) { return lhs._hook != rhs._hook; }
+       private:
+         friend class hash_impl;
+         const_iterator(const hash_impl* table, const hook_type* hook) : _table(table), _hook(hook) {}
+         const hash_impl* _table = nullptr;
+         const hook_type* _hook = nullptr;
+      };
+      using iterator = const_iterator;
+
+      hash_impl() = default;
+      template<typename A>
+      explicit hash_impl(const A& a) : _allocator(a) {}
+      hash_impl(const hash_impl&) = delete;
+      hash_impl& operator=(const hash_impl&) = delete;
+      ~hash_impl() {
+         free_buckets(_buckets, _bucket_count);
+         free_buckets(_old_buckets, _old_bucket_count);
+      }
+
+      const_iterator begin() const { return const_iterator{this, first_from(_buckets.get(), 0)}; }
+      const_iterator end() const { return const_iterator{this, nullptr}; }
+      std::size_t size() const { return _size; }
+      bool empty() const { return _size == 0; }
+      std::size_t bucket_count() const { return _bucket_count; }
+      hasher hash_function() const { return hasher{}; }
+      key_equal key_eq() const { return key_equal{}; }
+
+      const_iterator iterator_to(const value_type& v) const { return const_iterator{this, &hook_of(v)}; }
+
+      template<typename K>
+      const_iterator find(const K& k) const {
+         if(!_size) return end();
+         const std::size_t h = hasher{}(k);
+         for(hook_type* hook = bucket(h)->get(); hook; hook = hook->_next.get()) {
+            if(hook->_hash == h && key_equal{}(key_from_value_type{}(value_of(*hook)), k))
+               return const_iterator{this, hook};
+         }
+         return end();
+      }
+      template<typename K>
+      std::size_t count(const K& k) const { return find(k) != end(); }
+      template<typename K>
+      std::pair<const_iterator, const_iterator> equal_range(const K& k) const {
+         auto it = find(k);
+         if(it == end()) return { it, it };
+         return { it, std::next(it) };
+      }
+
+      // Exception safety: strong
+      std::pair<const_iterator, bool> insert_unique(value_type& v) {
+         const std::size_t h = hasher{}(key_from_value_type{}(v));
+         if(_size) {
+            auto existing = find_equal(v, h);
+            if(existing != end()) return { existing, false };
+         }
+         if(_size + 1 > _bucket_count) grow();
+         migrate(migrate_step);
+         link(v, h);
+         return { iterator_to(v), true };
+      }
+
+      const_iterator erase(const_iterator it) noexcept {
+         const_iterator next = std::next(it);
+         unlink(*const_cast<hook_type*>(it._hook));
+         return next;
+      }
+
+      // Rehashes v after its key may have changed.  If unique and another object has the same key,
+      // returns false and leaves v in the index.
+      bool update(value_type& v, bool unique) noexcept {
+         hook_type& hook = hook_of(v);
+         const std::size_t h = hasher{}(key_from_value_type{}(v));
+         if(h != hook._hash) {
+            unlink(hook);
+            link(v, h);
+         }
+         if(unique) {
+            for(hook_type* other = bucket(h)->get(); other; other = other->_next.get()) {
+               if(other != &hook && other->_hash == h && key_equal{}(key_from_value_type{}(value_of(*other)), key_from_value_type{}(v)))
+                  return false;
+            }
+         }
+         return true;
+      }
+
+      void clear() noexcept {
+         // also constructs the new buckets that no old bucket has been moved to yet
+         for(std::size_t i = 0; i < _bucket_count; ++i) new (_buckets.get() + i) bucket_type();
+         free_buckets(_old_buckets, _old_bucket_count);
+         _old_buckets = nullptr;
+         _old_bucket_count = 0;
+         _size = 0;
+      }
+
+      // Bytes of bucket arrays
+      std::size_t allocated_bytes() const { return (_bucket_count + _old_bucket_count) * sizeof(bucket_type); }
+
+    private:
+      static hook_type& hook_of(const value_type& v) {
+         auto* holder = boost::intrusive::get_parent_from_member(const_cast<value_type*>(&v), &Node::_item);
+         return static_cast<hook_type&>(*static_cast<Node*>(holder));
+      }
+      static const value_type& value_of(const hook_type& hook) {
+         return static_cast<const Node&>(hook)._item;
+      }
+
+      // The table and bucket where objects with hash h are
+      std::pair<bucket_type*, std::size_t> bucket_of(std::size_t h) const {
+         if(_old_buckets) {
+            std::size_t i = h & (_old_bucket_count - 1);
+            if(i >= _migrated) return { _old_buckets.get(), i };
+         }
+         return { _buckets.get(), h & (_bucket_count - 1) };
+      }
+      bucket_type* bucket(std::size_t h) const {
+         auto [table, i] = bucket_of(h);
+         return table + i;
+      }
+      // The first object in bucket i or later, going on to the remaining old buckets after the end of the new table
+      const hook_type* first_from(const bucket_type* table, std::size_t i) const {
+         if(table == _buckets.get()) {
+            // While migrating, only new buckets [0, _migrated) and [old size, old size + _migrated) are constructed
+            const std::size_t end = _old_buckets ? _old_bucket_count + _migrated : _bucket_count;
+            for(; i < end; ++i) {
+               if(_old_buckets && i >= _migrated && i < _old_bucket_count) i = _old_bucket_count;
+               if(i < end && _buckets[i]) return _buckets[i].get();
+            }
+            table = _old_buckets.get();
+            i = _migrated;
+         }
+         if(table) {
+            for(; i < _old_bucket_count; ++i)
+               if(_old_buckets[i]) return _old_buckets[i].get();
+         }
+         return nullptr;
+      }
+
+      const_iterator find_equal(const value_type& v, std::size_t h) const {
+         for(hook_type* hook = bucket(h)->get(); hook; hook = hook->_next.get()) {
+            if(hook->_hash == h && key_equal{}(key_from_value_type{}(value_of(*hook)), key_from_value_type{}(v)))
+               return const_iterator{this, hook};
+         }
+         return end();
+      }
+
+      void link(value_type& v, std::size_t h) noexcept {
+         hook_type& hook = hook_of(v);
+         bucket_type* b = bucket(h);
+         hook._hash = h;
+         hook._next = *b;
+         *b = &hook;
+         ++_size;
+      }
+      void unlink(hook_type& hook) noexcept {
+         bucket_type* prev = bucket(hook._hash);
+         while(prev->get() != &hook) prev = &(*prev)->_next;
+         *prev = hook._next;
+         --_size;
+      }
+
+      // Leaves the buckets unconstructed
+      bucket_type* allocate_buckets(std::size_t n) {
+         auto p = alloc_traits::allocate(_allocator, n);
+         return &*p;
+      }
+      void free_buckets(offset_ptr<bucket_type>& buckets, std::size_t n) noexcept {
+         if(buckets) alloc_traits::deallocate(_allocator, typename alloc_traits::pointer{buckets.get()}, n);
+         buckets = nullptr;
+      }
+
+      void grow() {
+         if(_old_buckets) migrate(_old_bucket_count);
+         const std::size_t new_count = _bucket_count ? _bucket_count * 2 : initial_buckets;
+         bucket_type* new_buckets = allocate_buckets(new_count);
+         if(!_bucket_count) {
+            for(std::size_t i = 0; i < new_count; ++i) new (new_buckets + i) bucket_type();
+         } else {
+            _old_buckets = _buckets;
+            _old_bucket_count = _bucket_count;
+            _migrated = 0;
+         }
+         _buckets = new_buckets;
+         _bucket_count = new_count;
+      }
+      void migrate(std::size_t buckets) noexcept {
+         if(!_old_buckets) return;
+         for(std::size_t end = std::min(_migrated + buckets, _old_bucket_count); _migrated < end; ++_migrated) {
+            new (_buckets.get() + _migrated) bucket_type();
+            new (_buckets.get() + _migrated + _old_bucket_count) bucket_type();
+            for(hook_type* hook = _old_buckets[_migrated].get(); hook;) {
+               hook_type* next = hook->_next.get();
+               bucket_type* b = _buckets.get() + (hook->_hash & (_bucket_count - 1));
+               hook->_next = *b;
+               *b = hook;
+               hook = next;
+            }
+            _old_buckets[_migrated] = nullptr;
+         }
+         if(_migrated == _old_bucket_count)
+            free_buckets(_old_buckets, _old_bucket_count);
+         if(!_old_buckets)
+            _old_bucket_count = 0;
+      }
+
+      allocator_type          _allocator;
+      offset_ptr<bucket_type> _buckets;
+      offset_ptr<bucket_type> _old_buckets;
+      std::size_t             _bucket_count = 0;
+      std::size_t             _old_bucket_count = 0;
+      std::size_t             _migrated = 0;
+      std::size_t             _size = 0;
+   };
+
+}
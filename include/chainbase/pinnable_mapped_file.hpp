@@ -1,6 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <future>
+#include <memory>
 #include <system_error>
+#include <thread>
 #include <boost/interprocess/managed_mapped_file.hpp>
 #include <boost/interprocess/sync/file_lock.hpp>
 #include <boost/filesystem.hpp>
@@ -24,7 +29,8 @@ enum db_error_code {
    bad_header,
    no_access,
    aborted,
-   no_mlock
+   no_mlock,
+   no_auto_grow
 };
 
 const std::error_category& chainbase_error_category();
@@ -46,10 +52,24 @@ class pinnable_mapped_file {
       enum map_mode {
          mapped,
          heap,
-         locked
+         locked,
+         lazy_heap
       };
 
-      pinnable_mapped_file(const bfs::path& dir, bool writable, uint64_t shared_file_size, bool allow_dirty, map_mode mode, std::vector<std::string> hugepage_paths);
+      // Grows a writable database by increment bytes whenever less than that is free, up to max_size. Address space
+      // for max_size is reserved when the database is opened, so in heap and locked modes max_size must fit within
+      // the system's memory overcommit limits. Both must be multiples of 1MB; an increment of 0 disables growth.
+      struct auto_grow_policy {
+         uint64_t increment;
+         uint64_t max_size;
+      };
+
+      // io_threads is the number of threads used to copy the database file in and out of memory in heap and
+      // locked modes; 0 or 1 does all copying on the calling thread. transparent_huge_pages asks the kernel to back
+      // the database memory with transparent huge pages, which needs no hugetlbfs mount. It applies to heap, lazy_heap
+      // and locked modes without hugepage_paths; the shared file mapping of mapped mode cannot use them.
+      pinnable_mapped_file(const bfs::path& dir, bool writable, uint64_t shared_file_size, bool allow_dirty, map_mode mode, std::vector<std::string> hugepage_paths,
+                           unsigned io_threads = 0, bool transparent_huge_pages = false, auto_grow_policy auto_grow = auto_grow_policy());
       pinnable_mapped_file(pinnable_mapped_file&& o);
       pinnable_mapped_file& operator=(pinnable_mapped_file&&);
       pinnable_mapped_file(const pinnable_mapped_file&) = delete;
@@ -58,17 +78,73 @@ class pinnable_mapped_file {
 
       segment_manager* get_segment_manager() const { return _segment_manager;}
 
+      // Checkpoints the database to its file. The returned future becomes ready once the file has been synced to
+      // storage; a later flush() or destruction waits for an earlier one to complete.
+      std::future<void> flush();
+
+      // Number of bytes of the database memory currently mapped with transparent huge pages
+      size_t transparent_huge_page_bytes() const;
+
+      // Grows the database per the auto_grow_policy. grow() returns false when growth is disabled or max_size has
+      // been reached; grow_if_needed() only grows while less than the policy's increment, or bytes if that is more,
+      // is free.
+      bool grow();
+      void grow_if_needed(size_t bytes = 0) {
+         if(!_auto_grow.increment)
+            return;
+         const size_t wanted = std::max<size_t>(_auto_grow.increment, bytes);
+         while(_segment_manager->get_free_memory() < wanted && grow());
+      }
+      size_t get_size() const { return _size; }
+      // The size the database may reach by growing
+      size_t get_max_size() const { return _auto_grow.increment ? std::max<uint64_t>(_size, _auto_grow.max_size) : _size; }
+
+      struct segment_stats {
+         size_t size = 0;
+         size_t free_bytes = 0;
+         size_t free_blocks = 0;
+         size_t largest_free_block = 0;
+         // free_block_histogram[i] counts the free blocks of [2^i, 2^(i+1)) bytes
+         std::array<size_t, 64> free_block_histogram = {};
+         // Share of the free memory outside of the largest free block: 0 when all free memory is contiguous
+         double fragmentation() const { return free_bytes ? 1.0 - (double)largest_free_block/free_bytes : 0.0; }
+      };
+      // Walks the segment's free blocks, which are few compared to the allocations in it, under the segment lock.
+      // Nothing in the segment is written, so polling it does not dirty pages.
+      segment_stats get_segment_stats() const;
+
+      // Bytes of [addr, addr+size) within the database memory that are resident
+      size_t resident_bytes(const void* addr, size_t size) const;
+
+      // Gives free space at the end of the segment back to the file system and returns the new size. Only space
+      // after the last allocation can be released.
+      size_t shrink_to_fit();
+
    private:
       void                                          set_mapped_file_db_dirty(bool);
       void                                          load_database_file(boost::asio::io_service& sig_ios);
-      void                                          save_database_file();
-      bool                                          all_zeros(char* data, size_t sz);
+      void                                          write_database_file(const std::vector<char>& dirty, bool report_progress);
+      bool                                          sync_database_file();
+      bool                                          save_database_file();
+      void                                          wait_for_flush();
+      void                                          start_dirty_tracking();
+      void                                          stop_dirty_tracking();
+      std::vector<char>                             get_dirty_chunks(bool reprotect);
+      std::vector<char>                             get_chunks_to_save(bool reprotect);
+      bool                                          start_lazy_load();
+      void                                          stop_lazy_load();
+      static bool                                   all_zeros(const char* data, size_t sz);
       bip::mapped_region                            get_huge_region(const std::vector<std::string>& huge_paths);
+      bip::mapped_region                            get_anonymous_region(size_t size, bool transparent_huge_pages);
 
       bip::file_lock                                _mapped_file_lock;
       bfs::path                                     _data_file_path;
       std::string                                   _database_name;
       bool                                          _writable;
+      map_mode                                      _map_mode;
+      unsigned                                      _io_threads = 0;
+      auto_grow_policy                              _auto_grow;
+      size_t                                        _size = 0; //current size of the database; less than the mapping when growable
 
       bip::file_mapping                             _file_mapping;
       bip::mapped_region                            _file_mapped_region;
@@ -82,7 +158,17 @@ class pinnable_mapped_file {
 
       segment_manager*                              _segment_manager = nullptr;
 
+      //userfaultfd write-protecting _mapped_region so that only modified chunks are saved; -1 when not tracking
+      int                                           _dirty_tracking_fd = -1;
+
+      std::thread                                   _flush_thread;
+
+      //in lazy_heap mode, fills _mapped_region from the file on first touch and in the background
+      struct lazy_loader;
+      std::unique_ptr<lazy_loader>                  _lazy_loader;
+
       constexpr static unsigned                     _db_size_multiple_requirement = 1024*1024; //1MB
+      constexpr static unsigned                     _io_stripe_size = 16*_db_size_multiple_requirement;
 };
 
 std::istream& operator>>(std::istream& in, pinnable_mapped_file::map_mode& runtime);
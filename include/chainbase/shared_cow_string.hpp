@@ -60,11 +60,17 @@ namespace chainbase {
          other._data = nullptr;
       }
       shared_cow_string& operator=(const shared_cow_string& other) {
+         if (_alloc != other._alloc) {
+            copy_from_other_segment(other);
+            return *this;
+         }
          *this = shared_cow_string{other};
          return *this;
       }
       shared_cow_string& operator=(shared_cow_string&& other) {
-         if (this != &other) {
+         if (_alloc != other._alloc) {
+            copy_from_other_segment(other);
+         } else if (this != &other) {
             dec_refcount();
             _data = other._data;
             other._data = nullptr;
@@ -131,6 +137,15 @@ namespace chainbase {
       bool operator!=(const shared_cow_string& rhs) const { return !(*this == rhs); }
       const allocator_type& get_allocator() const { return _alloc; }
     private:
+      // Data can only be shared within a segment
+      void copy_from_other_segment(const shared_cow_string& other) {
+         if (other._data) {
+            assign(other.data(), other.size());
+         } else {
+            dec_refcount();
+            _data = nullptr;
+         }
+      }
       void dec_refcount() {
          if(_data && --_data->reference_count == 0) {
             _alloc.deallocate((char*)&*_data, sizeof(shared_cow_string) + _data->size + 1);
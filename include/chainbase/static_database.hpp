@@ -0,0 +1,107 @@
+#pragma once
+
+#include <chainbase/chainbase.hpp>
+
+#include <boost/mp11/algorithm.hpp>
+#include <boost/mp11/set.hpp>
+
+#include <tuple>
+
+namespace chainbase {
+
+   /**
+    * A database whose indices are given as template arguments rather than added at runtime. Indices are
+    * reached through a tuple instead of abstract_index and the type_id map, and undo, squash and commit pick
+    * the index of each undo state with a fold expression, so every call can be inlined.
+    *
+    * The segment has the same layout as that of a database with the same indices added, so either can open
+    * it. Every index with undo sessions in the segment must be among MultiIndexTypes.
+    */
+   template<typename... MultiIndexTypes>
+   class static_database : public database_base<static_database<MultiIndexTypes...>>
+   {
+         static_assert( sizeof...(MultiIndexTypes) > 0, "a static_database needs at least one index" );
+         static_assert( boost::mp11::mp_is_set< boost::mp11::mp_list<
+                           std::integral_constant<uint16_t, generic_index<MultiIndexTypes>::value_type::type_id>... > >::value,
+                        "the objects of a static_database must have distinct type_ids" );
+
+         using base = database_base<static_database>;
+
+      public:
+         using session = undo_session<static_database>;
+
+         static_database(const bfs::path& dir, database::open_flags flags = database::read_only, uint64_t shared_file_size = 0,
+                         bool allow_dirty = false, pinnable_mapped_file::map_mode db_map_mode = pinnable_mapped_file::map_mode::mapped,
+                         std::vector<std::string> hugepage_paths = std::vector<std::string>(), unsigned io_threads = 0,
+                         bool transparent_huge_pages = false,
+                         pinnable_mapped_file::auto_grow_policy auto_grow = pinnable_mapped_file::auto_grow_policy()) :
+            base(dir, flags & database::read_write, shared_file_size, allow_dirty, db_map_mode, hugepage_paths, io_threads,
+                 transparent_huge_pages, auto_grow),
+            _indices(open_index<MultiIndexTypes>(this->_db_file, this->_read_only, this->open_clock())...)
+         {
+         }
+
+         session start_undo_session( bool enabled )
+         {
+            this->_db_file.grow_if_needed();
+            if( enabled ) {
+               ++this->_clock->revision;
+               return session( *this );
+            } else {
+               return session();
+            }
+         }
+
+         // See database::reclaim_undo
+         size_t reclaim_undo( size_t max_records )
+         {
+            size_t done = 0;
+            ( ( done += get_mutable_index<MultiIndexTypes>().reclaim( max_records - done ) ), ... );
+            return done;
+         }
+
+         void set_revision( uint64_t revision )
+         {
+            ( get_mutable_index<MultiIndexTypes>().set_revision( revision ), ... );
+         }
+
+         template<typename MultiIndexType>
+         const generic_index<MultiIndexType>& get_index()const
+         {
+            return *std::get<generic_index<MultiIndexType>*>( _indices );
+         }
+
+         template<typename MultiIndexType, typename ByIndex>
+         auto get_index()const -> decltype( ((generic_index<MultiIndexType>*)( nullptr ))->indices().template get<ByIndex>() )
+         {
+            return get_index<MultiIndexType>().indices().template get<ByIndex>();
+         }
+
+         template<typename MultiIndexType>
+         generic_index<MultiIndexType>& get_mutable_index()
+         {
+            return *std::get<generic_index<MultiIndexType>*>( _indices );
+         }
+
+      private:
+         friend base;
+
+         // Calls f with the index that owns an undo_state linked to the clock
+         template<typename F>
+         void with_touched_index( const undo_touch& touch, F&& f )
+         {
+            bool found = ( ( touch.slot == generic_index<MultiIndexTypes>::value_type::type_id &&
+                             ( f( get_mutable_index<MultiIndexTypes>() ), true ) ) || ... );
+            if( !found )
+               BOOST_THROW_EXCEPTION( std::logic_error( "the index with type_id " + std::to_string( touch.slot ) +
+                                                        " has undo sessions but is not part of the static_database" ) );
+         }
+
+         // reclaim_undo goes through every index, so there is nothing to remember
+         template<typename Index>
+         void queue_reclaim( Index& ) {}
+
+         std::tuple<generic_index<MultiIndexTypes>*...> _indices;
+   };
+
+}  // namespace chainbase
@@ -13,10 +13,18 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/core/demangle.hpp>
 #include <boost/interprocess/interprocess_fwd.hpp>
+#include <chainbase/btree_index.hpp>
+#include <chainbase/hash_index.hpp>
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <type_traits>
 #include <sstream>
+#include <vector>
 
 namespace chainbase {
 
@@ -40,6 +48,33 @@ namespace chainbase {
       decltype(auto) operator()(const T& arg) const { return KeyExtractor{}(arg); }
    };
 
+   // The key of an ordered_non_unique index.  Objects with equivalent keys are ordered by id, which is the order
+   // that boost::multi_index gives them when they are inserted, and which undo cannot change.
+   template<typename Key, typename Id>
+   struct key_and_id {
+      Key key;
+      Id  id;
+   };
+   template<typename KeyExtractor, typename T>
+   struct get_key_and_id {
+      using type = key_and_id<decltype(KeyExtractor{}(std::declval<const T&>())), decltype(std::declval<const T&>().id)>;
+      type operator()(const T& arg) const { return { KeyExtractor{}(arg), arg.id }; }
+   };
+   // Breaks ties between equivalent keys using the id.  Lookups by key alone see all the equivalent keys as one.
+   template<typename Compare>
+   struct compare_key_and_id {
+      template<typename K, typename Id>
+      bool operator()(const key_and_id<K, Id>& lhs, const key_and_id<K, Id>& rhs) const {
+         if(Compare{}(lhs.key, rhs.key)) return true;
+         if(Compare{}(rhs.key, lhs.key)) return false;
+         return lhs.id < rhs.id;
+      }
+      template<typename K, typename Id, typename U>
+      bool operator()(const key_and_id<K, Id>& lhs, const U& rhs) const { return Compare{}(lhs.key, rhs); }
+      template<typename U, typename K, typename Id>
+      bool operator()(const U& lhs, const key_and_id<K, Id>& rhs) const { return Compare{}(lhs, rhs.key); }
+   };
+
    template<typename T>
    struct value_holder {
       template<typename... A>
@@ -116,9 +151,109 @@ namespace chainbase {
       static void set_previous(node_ptr n, node_ptr previous) { set_left(n, previous); }
    };
 
+   // A smaller hook for indices that live in a segment of less than 16 GiB.  The offsets are
+   // stored divided by the hook's alignment, which is raised to 8 to widen their range.
+   template<class Tag>
+   struct alignas(8) compact_offset_node_base {
+      compact_offset_node_base() = default;
+      compact_offset_node_base(const compact_offset_node_base&) {}
+      constexpr compact_offset_node_base& operator=(const compact_offset_node_base&) { return *this; }
+      std::int32_t _parent;
+      std::int32_t _left;
+      std::int32_t _right;
+      int _color;
+   };
+
+   template<class Tag>
+   struct compact_offset_node_traits {
+      using node = compact_offset_node_base<Tag>;
+      using node_ptr = node*;
+      using const_node_ptr = const node*;
+      using color = int;
+      static constexpr std::int32_t null_offset = INT32_MIN;
+      static constexpr std::ptrdiff_t scale = alignof(node);
+      static constexpr std::uint64_t max_distance = (std::uint64_t(1) << 31) * scale;
+      static node_ptr from_offset(const_node_ptr n, std::int32_t offset) {
+         if(offset == null_offset) return nullptr;
+         return (node_ptr)((char*)n + std::ptrdiff_t(offset) * scale);
+      }
+      static std::int32_t to_offset(const_node_ptr n, const_node_ptr other) {
+         if(other == nullptr) return null_offset;
+         std::ptrdiff_t result = ((char*)other - (char*)n) / scale;
+         assert(result > INT32_MIN && result <= INT32_MAX);
+         return static_cast<std::int32_t>(result);
+      }
+      static node_ptr get_parent(const_node_ptr n) { return from_offset(n, n->_parent); }
+      static void set_parent(node_ptr n, node_ptr parent) { n->_parent = to_offset(n, parent); }
+      static node_ptr get_left(const_node_ptr n) { return from_offset(n, n->_left); }
+      static void set_left(node_ptr n, node_ptr left) { n->_left = to_offset(n, left); }
+      static node_ptr get_right(const_node_ptr n) { return from_offset(n, n->_right); }
+      static void set_right(node_ptr n, node_ptr right) { n->_right = to_offset(n, right); }
+      // red-black tree
+      static color get_color(node_ptr n) { return n->_color; }
+      static void set_color(node_ptr n, color c) { n->_color = c; }
+      static color black() { return 0; }
+      static color red() { return 1; }
+      // avl tree
+      using balance = int;
+      static balance get_balance(node_ptr n) { return n->_color; }
+      static void set_balance(node_ptr n, balance c) { n->_color = c; }
+      static balance negative() { return -1; }
+      static balance zero() { return 0; }
+      static balance positive() { return 1; }
+
+      // list
+      static node_ptr get_next(const_node_ptr n) { return get_right(n); }
+      static void set_next(node_ptr n, node_ptr next) { set_right(n, next); }
+      static node_ptr get_previous(const_node_ptr n) { return get_left(n); }
+      static void set_previous(node_ptr n, node_ptr previous) { set_left(n, previous); }
+   };
+   static_assert(sizeof(compact_offset_node_base<void>) == 16 && alignof(compact_offset_node_base<void>) == 8);
+
+   /**
+    * Specialize this (using CHAINBASE_SET_COMPACT_HOOKS) to make an object's index nodes use
+    * 32-bit offsets.  This saves 16 bytes per index for every object, but requires the whole
+    * database to be smaller than 16 GiB, which database::add_index checks.
+    */
+   template<typename T>
+   struct use_compact_hooks : std::false_type {};
+
+   /**
+    *  This macro must be used at global scope and OBJECT_TYPE must be fully qualified
+    */
+   #define CHAINBASE_SET_COMPACT_HOOKS( OBJECT_TYPE ) \
+   namespace chainbase { template<> struct use_compact_hooks<OBJECT_TYPE> : std::true_type {}; }
+
+   /**
+    * Specialize this (using CHAINBASE_SET_ID_DIRECTORY) to have the index of an object type keep a
+    * table from ids to objects, so that finding an object by id takes constant time.  The table
+    * takes a pointer for every id that has been assigned.
+    */
+   template<typename T>
+   struct use_id_directory : std::false_type {};
+
+   /**
+    *  This macro must be used at global scope and OBJECT_TYPE must be fully qualified
+    */
+   #define CHAINBASE_SET_ID_DIRECTORY( OBJECT_TYPE ) \
+   namespace chainbase { template<> struct use_id_directory<OBJECT_TYPE> : std::true_type {}; }
+
+   // Position of an id in an id directory
+   template<typename Id>
+   std::uint64_t id_directory_slot(const Id& id) {
+      if constexpr (std::is_integral_v<Id>) {
+         return static_cast<std::uint64_t>(id);
+      } else {
+         return static_cast<std::uint64_t>(id._id);
+      }
+   }
+
+   template<typename T, typename Tag>
+   using node_traits_for = std::conditional_t<use_compact_hooks<T>::value, compact_offset_node_traits<Tag>, offset_node_traits<Tag>>;
+
    template<typename Node, typename Tag>
    struct offset_node_value_traits {
-      using node_traits = offset_node_traits<Tag>;
+      using node_traits = node_traits_for<typename Node::value_type, Tag>;
       using node_ptr = typename node_traits::node_ptr;
       using const_node_ptr = typename node_traits::const_node_ptr;
       using value_type = typename Node::value_type;
@@ -149,20 +284,39 @@ namespace chainbase {
    template<typename Tag, typename... Indices>
    using find_tag = boost::mp11::mp_find<boost::mp11::mp_list<index_tag<Indices>...>, Tag>;
 
-   template<typename K, typename Allocator>
-   using hook = offset_node_base<K>;
+   template<typename T, typename K>
+   using hook = typename node_traits_for<T, K>::node;
+
+   template<typename Range>
+   constexpr bool is_forward_range = std::is_base_of_v<std::forward_iterator_tag,
+      typename std::iterator_traits<decltype(std::begin(std::declval<Range&>()))>::iterator_category>;
+
+   template<typename OrderedIndex>
+   constexpr bool is_non_unique_index = false;
+   template<typename... T>
+   constexpr bool is_non_unique_index<boost::multi_index::ordered_non_unique<T...>> = true;
 
    template<typename Node, typename OrderedIndex>
    using set_base = boost::intrusive::avltree<
       typename Node::value_type,
       boost::intrusive::value_traits<offset_node_value_traits<Node, OrderedIndex>>,
-      boost::intrusive::key_of_value<get_key<typename OrderedIndex::key_from_value_type, typename Node::value_type>>,
-      boost::intrusive::compare<typename OrderedIndex::compare_type>>;
+      boost::intrusive::key_of_value<std::conditional_t<is_non_unique_index<OrderedIndex>,
+         get_key_and_id<typename OrderedIndex::key_from_value_type, typename Node::value_type>,
+         get_key<typename OrderedIndex::key_from_value_type, typename Node::value_type>>>,
+      boost::intrusive::compare<std::conditional_t<is_non_unique_index<OrderedIndex>,
+         compare_key_and_id<typename OrderedIndex::compare_type>,
+         typename OrderedIndex::compare_type>>>;
 
    template<typename OrderedIndex>
    constexpr bool is_valid_index = false;
    template<typename... T>
    constexpr bool is_valid_index<boost::multi_index::ordered_unique<T...>> = true;
+   template<typename... T>
+   constexpr bool is_valid_index<boost::multi_index::ordered_non_unique<T...>> = true;
+   template<typename... T>
+   constexpr bool is_valid_index<btree_unique<T...>> = true;
+   template<typename... T>
+   constexpr bool is_valid_index<boost::multi_index::hashed_unique<T...>> = true;
 
    template<typename Node, typename Tag>
    using list_base = boost::intrusive::slist<
@@ -203,6 +357,9 @@ namespace chainbase {
       auto equal_range(K&& k) const {
          return base_type::equal_range(static_cast<K&&>(k), this->key_comp());
       }
+      set_impl() = default;
+      template<typename A>
+      explicit set_impl(const A&) {}
       using base_type::begin;
       using base_type::end;
       using base_type::rbegin;
@@ -214,8 +371,23 @@ namespace chainbase {
       friend class undo_index;
    };
 
+   template<typename Node, typename Index>
+   struct index_container { using type = set_impl<Node, Index>; };
+   template<typename Node, typename... T>
+   struct index_container<Node, btree_unique<T...>> { using type = btree_impl<Node, btree_unique<T...>>; };
+   template<typename Node, typename... T>
+   struct index_container<Node, boost::multi_index::hashed_unique<T...>> { using type = hash_impl<Node, boost::multi_index::hashed_unique<T...>>; };
+   template<typename Node, typename Index>
+   using index_container_t = typename index_container<Node, Index>::type;
+
+   template<typename T, typename Index>
+   using index_hook = std::conditional_t<is_btree_index<Index>, btree_hook<Index>,
+                      std::conditional_t<is_hashed_index<Index>, hash_hook<Index>, hook<T, Index>>>;
+
    template<typename T, typename S>
    class chainbase_node_allocator;
+   template<typename T, typename S>
+   class chainbase_record_allocator;
 
    // Allows nested object to use a different allocator from the container.
    template<template<typename> class A, typename T>
@@ -229,19 +401,146 @@ namespace chainbase {
    template<typename T, typename S>
    auto propagate_allocator(chainbase::chainbase_node_allocator<T, S>& a) { return boost::interprocess::allocator<T, S>{a.get_segment_manager()}; }
 
+   // Bytes an allocator holds on to without them being in use
+   template<typename A>
+   std::size_t allocator_freelist_bytes(const A&) { return 0; }
+   template<typename T, typename S>
+   std::size_t allocator_freelist_bytes(const chainbase::chainbase_node_allocator<T, S>& a) { return a.freelist_bytes(); }
+   template<typename T, typename S>
+   std::size_t allocator_freelist_bytes(const chainbase::chainbase_record_allocator<T, S>& a) { return a.freelist_bytes(); }
+
+   // The allocator of old_values and field_values, which the chainbase allocator bump allocates
+   template<typename A, typename U>
+   struct undo_record_allocator { using type = rebind_alloc_t<A, U>; };
+   template<typename T, typename S, typename U>
+   struct undo_record_allocator<chainbase::chainbase_node_allocator<T, S>, U> { using type = chainbase::chainbase_record_allocator<U, S>; };
+   template<typename A, typename U>
+   using undo_record_allocator_t = typename undo_record_allocator<A, U>::type;
+
+   template<typename A>
+   void allocator_reserve_arena(A&, std::size_t) {
+      BOOST_THROW_EXCEPTION( std::logic_error("the index allocator does not support arenas") );
+   }
+   template<typename T, typename S>
+   void allocator_reserve_arena(chainbase::chainbase_node_allocator<T, S>& a, std::size_t bytes) { a.reserve_arena(bytes); }
+   template<typename A>
+   std::pair<const char*, std::size_t> allocator_arena(const A&) { return { nullptr, 0 }; }
+   template<typename T, typename S>
+   std::pair<const char*, std::size_t> allocator_arena(const chainbase::chainbase_node_allocator<T, S>& a) { return a.arena(); }
+
+   struct undo_index_memory_stats {
+      std::size_t nodes = 0;
+      std::size_t node_bytes = 0;
+      std::size_t freelist_bytes = 0;
+      std::size_t old_values = 0;
+      std::size_t old_values_bytes = 0;
+      std::size_t removed_values = 0;
+      std::size_t removed_values_bytes = 0;
+      std::size_t field_values = 0;
+      std::size_t field_values_bytes = 0;
+      std::size_t index_bytes = 0; // btree nodes, hash buckets and the id directory
+   };
+
+   // The undo state of one index in one undo session, linked with the others of every index that shares an undo_clock
+   struct undo_touch {
+      boost::interprocess::offset_ptr<undo_touch> prev; // older
+      boost::interprocess::offset_ptr<undo_touch> next; // newer
+      int64_t revision = 0;
+      uint32_t slot = 0;
+   };
+
+   // The revision and undo sessions of a group of indices.  Starting a session only increments the revision.
+   // An index pushes an undo state when it is first written in a session and links it here, so that undo,
+   // squash and commit only need to visit the indices that were written.  The links are ordered by revision.
+   struct undo_clock {
+      int64_t revision = 0;
+      int64_t first = 0; // revision - the number of sessions
+      boost::interprocess::offset_ptr<undo_touch> oldest;
+      boost::interprocess::offset_ptr<undo_touch> newest;
+      bool has_session() const { return revision != first; }
+      void link(undo_touch& t) noexcept {
+         t.prev = newest;
+         t.next = nullptr;
+         if(newest) newest->next = &t;
+         else oldest = &t;
+         newest = &t;
+      }
+      bool linked(const undo_touch& t) const noexcept { return t.prev || t.next || oldest.get() == &t; }
+      // Does nothing if t has already been unlinked, so that the owner can detach the undo_states it is about to
+      // process and then let the indices process them concurrently.
+      void unlink(undo_touch& t) noexcept {
+         if(!linked(t)) return;
+         if(t.prev) t.prev->next = t.next;
+         else oldest = t.next;
+         if(t.next) t.next->prev = t.prev;
+         else newest = t.prev;
+         t.prev = t.next = nullptr;
+      }
+
+      // Calls f for each undo_touch that undo or squash of the current session would process
+      template<typename F>
+      void for_each_current(F&& f) const {
+         if(!has_session()) return;
+         for(const undo_touch* t = newest.get(); t && t->revision == revision; t = t->prev.get()) f(*t);
+      }
+      // Calls f for each undo_touch that commit(rev) would process
+      template<typename F>
+      void for_each_committed(int64_t rev, F&& f) const {
+         rev = std::min(rev, revision);
+         for(const undo_touch* t = oldest.get(); t && t->revision <= rev; t = t->next.get()) f(*t);
+      }
+
+      // The following are driven by the owner of the clock.  Each function is called with an undo_touch and
+      // must call the corresponding member of the undo_index that owns it, which unlinks or relabels it.
+
+      // Undoes the current session, calling undo_touched for each index written in it
+      template<typename F>
+      void undo(F&& undo_touched) {
+         if(!has_session()) return;
+         while(newest && newest->revision == revision) undo_touched(*newest);
+         --revision;
+      }
+      // Combines the current session with the previous one, calling squash_touched for each index written in it
+      template<typename F>
+      void squash(F&& squash_touched) {
+         if(!has_session()) return;
+         for(undo_touch* t = newest.get(); t && t->revision == revision;) {
+            undo_touch* older = t->prev.get();
+            squash_touched(*t);
+            t = older;
+         }
+         --revision;
+      }
+      // Discards the sessions up to rev, calling commit_undo_states for each index written in them
+      template<typename F>
+      void commit(int64_t rev, F&& commit_undo_states) {
+         rev = std::min(rev, revision);
+         while(oldest && oldest->revision <= rev) commit_undo_states(*oldest, rev);
+         first = std::max(first, rev);
+      }
+   };
+
    // Similar to boost::multi_index_container with an undo stack.
-   // Indices should be instances of ordered_unique.
+   // Indices should be instances of ordered_unique.  Indices other than the first may also be ordered_non_unique,
+   // btree_unique or hashed_unique.
    template<typename T, typename Allocator, typename... Indices>
    class undo_index {
     public:
       using id_type = std::decay_t<decltype(std::declval<T>().id)>;
       using value_type = T;
       using allocator_type = Allocator;
+      // The largest segment that the nodes and the index can live in, or 0 if unlimited
+      static constexpr std::uint64_t max_segment_size = use_compact_hooks<T>::value ?
+         compact_offset_node_traits<void>::max_distance : 0;
 
-      static_assert((... && is_valid_index<Indices>), "Only ordered_unique indices are supported");
+      static_assert((... && is_valid_index<Indices>), "Only ordered_unique, ordered_non_unique, btree_unique and hashed_unique indices are supported");
+      static_assert(!is_non_unique_index<boost::mp11::mp_first<boost::mp11::mp_list<Indices...>>> &&
+                    !is_btree_index<boost::mp11::mp_first<boost::mp11::mp_list<Indices...>>> &&
+                    !is_hashed_index<boost::mp11::mp_first<boost::mp11::mp_list<Indices...>>>, "the id index must be ordered_unique");
 
       undo_index() = default;
-      explicit undo_index(const Allocator& a) : _undo_stack{a}, _allocator{a}, _old_values_allocator{a} {}
+      explicit undo_index(const Allocator& a) : _indices{index_arg<Indices>(a)...}, _undo_stack{a}, _allocator{a}, _old_values_allocator{a},
+                                                _field_values_allocator{a}, _id_directory{make_id_directory(a)} {}
       ~undo_index() {
          dispose_undo();
          clear_impl<1>();
@@ -253,7 +552,7 @@ namespace chainbase {
             BOOST_THROW_EXCEPTION( std::runtime_error("content of memory does not match data expected by executable") );
       }
     
-      struct node : hook<Indices, Allocator>..., value_holder<T> {
+      struct node : index_hook<T, Indices>..., value_holder<T> {
          using value_type = T;
          using allocator_type = Allocator;
          template<typename... A>
@@ -263,7 +562,7 @@ namespace chainbase {
       };
       static constexpr int erased_flag = 2; // 0,1,and -1 are used by the tree
 
-      using indices_type = std::tuple<set_impl<node, Indices>...>;
+      using indices_type = std::tuple<index_container_t<node, Indices>...>;
 
       using index0_set_type = std::tuple_element_t<0, indices_type>;
       using alloc_traits = typename std::allocator_traits<Allocator>::template rebind_traits<node>;
@@ -271,7 +570,7 @@ namespace chainbase {
       static_assert(std::is_same_v<typename index0_set_type::key_type, id_type>, "first index must be id");
 
       using index0_type = boost::mp11::mp_first<boost::mp11::mp_list<Indices...>>;
-      struct old_node : hook<index0_type, Allocator>, value_holder<T> {
+      struct old_node : hook<T, index0_type>, value_holder<T> {
          using value_type = T;
          using allocator_type = Allocator;
          template<typename... A>
@@ -280,6 +579,24 @@ namespace chainbase {
          typename alloc_traits::pointer _current; // pointer to the actual node
       };
 
+      // Saved bytes of an object, written by modify_fields instead of a whole old_node.  Ranges longer
+      // than capacity take several field_nodes.
+      struct field_node {
+         static constexpr std::size_t capacity = 32;
+         using hook_type = boost::intrusive::slist_member_hook<
+            boost::intrusive::void_pointer<typename std::allocator_traits<Allocator>::void_pointer>,
+            boost::intrusive::link_mode<boost::intrusive::normal_link>>;
+         const T& current() const { return _current->_item; }
+         hook_type _hook;
+         typename alloc_traits::pointer _current; // the node that the bytes were taken from
+         uint64_t _mtime = 0; // The node's _mtime, which modify_fields leaves unchanged
+         uint32_t _offset = 0;
+         uint32_t _size = 0;
+         char _bytes[capacity];
+      };
+      using field_list_type = boost::intrusive::slist<field_node,
+         boost::intrusive::member_hook<field_node, typename field_node::hook_type, &field_node::_hook>>;
+
       using id_pointer = id_type*;
       using pointer = value_type*;
       using const_iterator = typename index0_set_type::const_iterator;
@@ -306,6 +623,9 @@ namespace chainbase {
       // If a primary key exists in both removed_values AND old_values, undo will restore the value from old_values.
       // A primary key may appear in old_values any number of times.  If it appears more than once
       //   within a single undo session, undo will restore the oldest value.
+      // A primary key that is in field_values before field_values_end had some of its bytes modified.  Within
+      //   an undo session, all of these modifications come before the one saved in old_values, if any, so
+      //   undo applies field_values after old_values.
       //
       // The following describes the minimal set of operations required to maintain the undo stack:
       // start session: remember next_id and the current heads of old_values and removed_values.
@@ -332,16 +652,25 @@ namespace chainbase {
       struct undo_state {
          typename std::allocator_traits<Allocator>::pointer old_values_end;
          typename std::allocator_traits<Allocator>::pointer removed_values_end;
+         typename std::allocator_traits<undo_record_allocator_t<Allocator, field_node>>::pointer field_values_end;
          id_type old_next_id = 0;
          uint64_t ctime = 0; // _monotonic_revision at the point the undo_state was created
+         undo_touch touch; // The revision of the session
+         std::size_t records = 0; // undo_records() and size() when the undo_state was created
+         std::size_t size = 0;
       };
 
       // Exception safety: strong
       template<typename Constructor>
       const value_type& emplace( Constructor&& c ) {
+         current_undo_state();
+         auto new_id = _next_id;
+         if constexpr (has_id_directory) {
+            if(_id_directory.size() <= id_directory_slot(new_id))
+               _id_directory.resize(id_directory_slot(new_id) + 1);
+         }
          auto p = alloc_traits::allocate(_allocator, 1);
          auto guard0 = scope_exit{[&]{ alloc_traits::deallocate(_allocator, p, 1); }};
-         auto new_id = _next_id;
          auto constructor = [&]( value_type& v ) {
             v.id = new_id;
             c( v );
@@ -351,6 +680,7 @@ namespace chainbase {
          if(!insert_impl<1>(p->_item))
             BOOST_THROW_EXCEPTION( std::logic_error{ "could not insert object, most likely a uniqueness constraint was violated" } );
          std::get<0>(_indices).push_back(p->_item); // cannot fail and we know that it will definitely insert at the end.
+         set_id_directory(new_id, &*p);
          on_create(p->_item);
          ++_next_id;
          guard1.cancel();
@@ -358,6 +688,52 @@ namespace chainbase {
          return p->_item;
       }
 
+      // Creates an object for each constructor in the range, as if by emplace.  The ordered indices are
+      // filled by appending the objects in sorted order, which costs amortized constant time per object
+      // instead of a search and a rebalance.  The range is traversed once, so it may be single pass.  Objects
+      // already in key order are not sorted again.  There must not be an undo session.
+      // Exception safety: strong
+      template<typename Constructors>
+      void bulk_load( Constructors&& constructors ) {
+         if(_clock->has_session())
+            BOOST_THROW_EXCEPTION( std::logic_error{ "bulk_load requires an empty undo stack" } );
+         std::vector<value_type*> objects;
+         if constexpr (is_forward_range<Constructors>)
+            objects.reserve(std::distance(std::begin(constructors), std::end(constructors)));
+         auto guard0 = scope_exit{[&]{ for(value_type* p : objects) dispose_node(*p); }};
+         auto new_id = _next_id;
+         for(auto&& c : constructors) {
+            // The range may be single pass, and then its size is unknown
+            if(objects.size() == objects.capacity())
+               objects.reserve(objects.size() * 2 + 64);
+            auto p = alloc_traits::allocate(_allocator, 1);
+            auto guard1 = scope_exit{[&]{ alloc_traits::deallocate(_allocator, p, 1); }};
+            auto constructor = [&]( value_type& v ) {
+               v.id = new_id;
+               c( v );
+            };
+            alloc_traits::construct(_allocator, &*p, constructor, propagate_allocator(_allocator));
+            guard1.cancel();
+            objects.push_back(&p->_item);
+            ++new_id;
+         }
+         if(objects.empty()) return;
+         if constexpr (has_id_directory) {
+            if(_id_directory.size() <= id_directory_slot(new_id - 1))
+               _id_directory.resize(id_directory_slot(new_id - 1) + 1);
+         }
+         auto& by_id = std::get<0>(_indices);
+         for(value_type* p : objects)
+            by_id.push_back(*p);
+         auto guard2 = scope_exit{[&]{ by_id.erase(by_id.lower_bound(_next_id), by_id.end()); }};
+         bulk_insert_impl(objects);
+         for(value_type* p : objects)
+            set_id_directory(p->id, &to_node(*p));
+         _next_id = new_id;
+         guard2.cancel();
+         guard0.cancel();
+      }
+
       // Exception safety: basic.
       // If the modifier leaves the object in a state that conflicts
       // with another object, it will either be reverted or erased.
@@ -392,16 +768,90 @@ namespace chainbase {
             BOOST_THROW_EXCEPTION( std::logic_error{ "could not modify object, most likely a uniqueness constraint was violated" } );
       }
 
-      void remove( const value_type& obj ) noexcept {
+      // Like modify, but only saves the given members for undo, rather than a copy of the whole object.
+      // Without any members, the object must be trivially copyable and the bytes that the modifier
+      // changed are saved.  The modifier must not change anything else.
+      // Exception safety: strong when the fields are saved, otherwise the same as modify.
+      template<typename Modifier, typename... Fields>
+      void modify_fields( const value_type& obj, Modifier&& m, Fields... fields ) {
+         undo_state* state = current_undo_state();
+         if(!state || to_node(obj)._mtime >= state->ctime) {
+            // Not needed for undo
+            modify(obj, m);
+            return;
+         }
+         value_type& node_ref = const_cast<value_type&>(obj);
+         field_node* saved_end = _field_values.empty() ? nullptr : &_field_values.front();
+         if constexpr (sizeof...(Fields) == 0) {
+            static_assert(std::is_trivially_copyable_v<value_type>, "modify_fields can only find the changed bytes of a trivially copyable object");
+            alignas(value_type) char before[sizeof(value_type)];
+            std::memcpy(before, &obj, sizeof(value_type));
+            auto guard = scope_exit{[&]{
+               pop_fields(saved_end);
+               std::memcpy(static_cast<void*>(&node_ref), before, sizeof(value_type));
+            }};
+            m(node_ref);
+            const char* after = reinterpret_cast<const char*>(&obj);
+            for(std::size_t offset = 0; offset < sizeof(value_type); offset += field_node::capacity) {
+               std::size_t size = std::min(field_node::capacity, sizeof(value_type) - offset);
+               if(std::memcmp(before + offset, after + offset, size) != 0)
+                  save_fields(obj, offset, before + offset, size);
+            }
+            guard.cancel();
+         } else {
+            static_assert((... && std::is_trivially_copyable_v<std::remove_reference_t<decltype(obj.*fields)>>), "modify_fields can only save trivially copyable members");
+            auto guard = scope_exit{[&]{ restore_fields(saved_end); }};
+            (save_fields(obj, reinterpret_cast<const char*>(&(obj.*fields)) - reinterpret_cast<const char*>(&obj),
+                         reinterpret_cast<const char*>(&(obj.*fields)), sizeof(obj.*fields)), ...);
+            auto old_id = obj.id;
+            m(node_ref);
+            (void)old_id;
+            assert(obj.id == old_id);
+            guard.cancel();
+         }
+         if(!post_modify<true, 1>(node_ref)) {
+            restore_fields(saved_end);
+            bool success = post_modify<true, 1>(node_ref);
+            (void)success;
+            assert(success);
+            BOOST_THROW_EXCEPTION( std::logic_error{ "could not modify object, most likely a uniqueness constraint was violated" } );
+         }
+      }
+
+      // Like modify, for modifiers that leave every key of the object unchanged.  The indices are not
+      // touched.  Builds with assertions check that the object is still in order.
+      // Exception safety: basic.
+      template<typename Modifier>
+      void modify_nonkey( const value_type& obj, Modifier&& m) {
+         on_modify(obj);
+         auto old_id = obj.id;
+         m(const_cast<value_type&>(obj));
+         (void)old_id;
+         assert(obj.id == old_id);
+         assert(is_in_place(obj));
+      }
+
+      // Exception safety: strong
+      void remove( const value_type& obj ) {
+         current_undo_state();
          auto& node_ref = const_cast<value_type&>(obj);
          erase_impl(node_ref);
+         set_id_directory(obj.id, nullptr);
          if(on_remove(node_ref)) {
             dispose_node(node_ref);
          }
+         if(_undo_stack.empty()) {
+            trim_impl();
+         }
       }
 
       template<typename CompatibleKey>
       const value_type* find( CompatibleKey&& key) const {
+         if constexpr (has_id_directory && std::is_same_v<std::decay_t<CompatibleKey>, id_type>) {
+            auto slot = id_directory_slot(key);
+            if (slot >= _id_directory.size() || !_id_directory[slot]) return nullptr;
+            return &_id_directory[slot]->_item;
+         }
          const auto& index = std::get<0>(_indices);
          auto iter = index.find(static_cast<CompatibleKey&&>(key));
          if (iter != index.end()) {
@@ -464,43 +914,78 @@ namespace chainbase {
          bool _apply = true;
       };
 
-      int64_t revision() const { return _revision; }
+      int64_t revision() const { return _clock->revision; }
 
       session start_undo_session( bool enabled ) {
          return session{*this, enabled};
       }
 
+      // Copies every object into other, keeping their ids along with the next id and the revision, so that the
+      // index can be rebuilt densely in another segment. The copy assignment of value_type must copy any members
+      // holding segment memory into the segment of the object assigned to.
+      void copy_into( undo_index& other ) const {
+         if( has_undo_session() || other.has_undo_session() )
+            BOOST_THROW_EXCEPTION( std::logic_error("cannot copy an index while there is an existing undo stack") );
+         if( !other.empty() )
+            BOOST_THROW_EXCEPTION( std::logic_error("cannot copy into an index that is not empty") );
+         for(const value_type& obj : std::get<0>(_indices)) {
+            other._next_id = obj.id;
+            other.emplace([&](value_type& v) { v = obj; });
+         }
+         other._next_id = _next_id;
+         other._clock->revision = other._clock->first = _clock->revision;
+      }
+
       void set_revision( uint64_t revision ) {
-         if( _undo_stack.size() != 0 )
+         if( has_undo_session() )
             BOOST_THROW_EXCEPTION( std::logic_error("cannot set revision while there is an existing undo stack") );
 
          if( revision > std::numeric_limits<int64_t>::max() )
             BOOST_THROW_EXCEPTION( std::logic_error("revision to set is too high") );
 
-         if( revision < _revision )
+         if( revision < static_cast<uint64_t>(_clock->revision) )
             BOOST_THROW_EXCEPTION( std::logic_error("revision cannot decrease") );
 
-         _revision = static_cast<int64_t>(revision);
+         _clock->revision = _clock->first = static_cast<int64_t>(revision);
       }
 
       std::pair<int64_t, int64_t> undo_stack_revision_range() const {
-         return { _revision - _undo_stack.size(), _revision };
+         return { _clock->first, _clock->revision };
       }
 
       /**
        * Discards all undo history prior to revision
        */
       void commit( int64_t revision ) noexcept {
-         revision = std::min(revision, _revision);
-         if (revision == _revision) {
-            dispose_undo();
-            _undo_stack.clear();
-         } else if( (_revision - revision) < _undo_stack.size() ) {
-            auto iter = _undo_stack.begin() + (_undo_stack.size() - (_revision - revision));
-            dispose(get_old_values_end(*iter), get_removed_values_end(*iter));
-            _undo_stack.erase(_undo_stack.begin(), iter);
-         }
+         revision = std::min(revision, _clock->revision);
+         commit_undo_states(revision);
+         _clock->first = std::max(_clock->first, revision);
+         reclaim(std::numeric_limits<std::size_t>::max());
+      }
+
+      // Frees up to max_records of the objects that committed sessions saved for undo, and returns the number
+      // freed.  commit_undo_states only marks them, so that its cost does not depend on how much is committed.
+      // Returns less than max_records once there is nothing left to free.
+      std::size_t reclaim( std::size_t max_records ) noexcept {
+         std::size_t done = reclaim_list(_old_values, _old_values_expired, max_records, [this](pointer p){ dispose_old(*p); });
+         done += reclaim_list(_removed_values, _removed_values_expired, max_records - done, [this](pointer p){ dispose_node(*p); });
+         done += reclaim_list(_field_values, _field_values_expired, max_records - done, [this](auto p){ dispose_field(*p); });
+         return done;
+      }
+
+      // Makes the index share the revision and undo sessions of the other indices using clock.  Once attached,
+      // sessions are started, undone, squashed and committed through the clock's owner, which calls
+      // undo_touched, squash_touched and commit_undo_states for the indices linked to the clock.
+      void attach_clock( undo_clock& clock, uint32_t slot ) {
+         if( _clock.get() == &clock )
+            return;
+         if( has_undo_session() || _undo_stack.size() != 0 )
+            BOOST_THROW_EXCEPTION( std::logic_error("cannot attach an index with an undo stack to a clock") );
+         _clock = &clock;
+         _clock_slot = slot;
       }
+      bool uses_clock( const undo_clock& clock ) const { return _clock.get() == &clock; }
+
 
       const undo_index& indices() const { return *this; }
       template<typename Tag>
@@ -524,50 +1009,87 @@ namespace chainbase {
 
       template<int N, typename Iter>
       auto project(Iter iter) const {
-         if(iter == get<boost::mp11::mp_find<boost::mp11::mp_list<typename set_impl<node, Indices>::const_iterator...>, Iter>::value>().end())
+         if(iter == get<boost::mp11::mp_find<boost::mp11::mp_list<typename index_container_t<node, Indices>::const_iterator...>, Iter>::value>().end())
             return get<N>().end();
          return get<N>().iterator_to(*iter);
       }
 
-      bool has_undo_session() const { return !_undo_stack.empty(); }
+      bool has_undo_session() const { return _clock->has_session(); }
+
+      // Sets aside a contiguous part of the segment for the nodes of this index so that they share fewer pages
+      // with other indices, and so that the memory of the index can be managed as a unit.
+      void reserve_arena( std::size_t bytes ) { allocator_reserve_arena(_allocator, bytes); }
+      std::pair<const char*, std::size_t> arena() const { return allocator_arena(_allocator); }
+
+      // Constant time, so cheap enough to poll
+      undo_index_memory_stats memory_stats() const {
+         undo_index_memory_stats result;
+         result.nodes = size();
+         result.node_bytes = result.nodes * sizeof(node);
+         result.freelist_bytes = allocator_freelist_bytes(_allocator) + allocator_freelist_bytes(_old_values_allocator) +
+                                 allocator_freelist_bytes(_field_values_allocator);
+         result.old_values = _old_values.size();
+         result.old_values_bytes = result.old_values * sizeof(old_node);
+         result.removed_values = _removed_values.size();
+         result.removed_values_bytes = result.removed_values * sizeof(node);
+         result.field_values = _field_values.size();
+         result.field_values_bytes = result.field_values * sizeof(field_node);
+         result.index_bytes = index_bytes_impl();
+         if constexpr (has_id_directory) {
+            result.index_bytes += _id_directory.size() * sizeof(typename alloc_traits::pointer);
+         }
+         return result;
+      }
 
       struct delta {
          boost::iterator_range<typename index0_set_type::const_iterator> new_values;
          boost::iterator_range<typename list_base<old_node, index0_type>::const_iterator> old_values;
          boost::iterator_range<typename list_base<node, index0_type>::const_iterator> removed_values;
+         // Objects changed by modify_fields that are not in old_values.  An object may appear several times.
+         boost::iterator_range<typename field_list_type::const_iterator> field_values;
       };
 
       delta last_undo_session() const {
-        if(_undo_stack.empty())
+        if(!has_current_undo_state())
            return { { get<0>().end(), get<0>().end() },
                     { _old_values.end(), _old_values.end() },
-                    { _removed_values.end(), _removed_values.end() } };
+                    { _removed_values.end(), _removed_values.end() },
+                    { _field_values.end(), _field_values.end() } };
          // Warning: This is safe ONLY as long as nothing exposes the undo stack to client code.
          // Compressing the undo stack does not change the logical state of the undo_index.
          const_cast<undo_index*>(this)->compress_last_undo_session();
          return { { get<0>().lower_bound(_undo_stack.back().old_next_id), get<0>().end() },
                   { _old_values.begin(), get_old_values_end(_undo_stack.back()) },
-                  { _removed_values.begin(), get_removed_values_end(_undo_stack.back()) } };
+                  { _removed_values.begin(), get_removed_values_end(_undo_stack.back()) },
+                  { _field_values.begin(), get_field_values_end(_undo_stack.back()) } };
       }
 
       auto begin() const { return get<0>().begin(); }
       auto end() const { return get<0>().end(); }
 
       void undo_all() {
-         while(!_undo_stack.empty()) {
+         while(has_undo_session()) {
             undo();
          }
       }
 
       // Resets the contents to the state at the top of the undo stack.
       void undo() noexcept {
-         if (_undo_stack.empty()) return;
+         if (!has_undo_session()) return;
+         undo_touched();
+         --_clock->revision;
+      }
+
+      // Undoes the changes of the current session to this index, without changing the revision
+      void undo_touched() noexcept {
+         if (!has_current_undo_state()) return;
          undo_state& undo_info = _undo_stack.back();
          // erase all new_ids
          auto& by_id = std::get<0>(_indices);
          auto new_ids_iter = by_id.lower_bound(undo_info.old_next_id);
          by_id.erase_and_dispose(new_ids_iter, by_id.end(), [this](pointer p){
             erase_impl<1>(*p);
+            set_id_directory(p->id, nullptr);
             dispose_node(*p);
          });
          // replace old_values
@@ -590,18 +1112,29 @@ namespace chainbase {
             }
             dispose_old(*p);
          });
+         // restore bytes saved by modify_fields
+         _field_values.erase_after_and_dispose(_field_values.before_begin(), get_field_values_end(undo_info), [this, &undo_info](auto p) {
+            if(p->_mtime < undo_info.ctime) {
+               auto& item = p->_current->_item;
+               std::memcpy(reinterpret_cast<char*>(&item) + p->_offset, p->_bytes, p->_size);
+               if (get_removed_field(item) != erased_flag) {
+                  post_modify<false, 1>(item);
+               }
+            }
+            dispose_field(*p);
+         });
          // insert all removed_values
          _removed_values.erase_after_and_dispose(_removed_values.before_begin(), get_removed_values_end(undo_info), [this, &undo_info](pointer p) {
             if (p->id < undo_info.old_next_id) {
                get_removed_field(*p) = 0; // Will be overwritten by tree algorithms, because we're reusing the color.
                insert_impl(*p);
+               set_id_directory(p->id, &to_node(*p));
             } else {
                dispose_node(*p);
             }
          });
          _next_id = undo_info.old_next_id;
-         _undo_stack.pop_back();
-         --_revision;
+         pop_undo_state();
       }
 
       // Combines the top two states on the undo stack
@@ -610,24 +1143,76 @@ namespace chainbase {
       }
 
       void squash_fast() noexcept {
-         if (_undo_stack.empty()) {
-            return;
-         } else if (_undo_stack.size() == 1) {
+         if (!has_undo_session()) return;
+         squash_touched<false>();
+         --_clock->revision;
+      }
+
+      void squash_and_compress() noexcept {
+         if (!has_undo_session()) return;
+         squash_touched<true>();
+         --_clock->revision;
+      }
+
+      // Merges the changes of the current session to this index into the previous session, without changing
+      // the revision.  Returns true if the index had no changes in the previous session, in which case its
+      // undo_state is relabeled and stays linked to the clock.
+      template<bool compress = true>
+      bool squash_touched() noexcept {
+         if (!has_current_undo_state()) return false;
+         const int64_t revision = _clock->revision;
+         if (revision - 1 == _clock->first) {
+            // The previous session has been committed
             dispose_undo();
+            pop_undo_state();
+            return false;
          }
-         _undo_stack.pop_back();
-         --_revision;
+         if (_undo_stack.size() >= 2 && _undo_stack[_undo_stack.size() - 2].touch.revision == revision - 1) {
+            if constexpr (compress) {
+               compress_impl(_undo_stack[_undo_stack.size() - 2]);
+            }
+            pop_undo_state();
+            return false;
+         }
+         _undo_stack.back().touch.revision = revision - 1;
+         return true;
       }
 
-      void squash_and_compress() noexcept {
-         if(_undo_stack.size() >= 2) {
-            compress_impl(_undo_stack[_undo_stack.size() - 2]);
+      // The number of objects saved for undo
+      std::size_t undo_records() const {
+         return _old_values.size() + _removed_values.size() + _field_values.size();
+      }
+      // Estimates the work of undo_touched or squash_touched
+      std::size_t session_records() const {
+         if (!has_current_undo_state()) return 0;
+         const undo_state& state = _undo_stack.back();
+         std::size_t records = undo_records();
+         std::size_t objects = size();
+         return (records > state.records ? records - state.records : 0) +
+                (objects > state.size ? objects - state.size : state.size - objects);
+      }
+
+      // Discards the undo_states of sessions up to revision.  The objects they saved are left for reclaim.
+      void commit_undo_states( int64_t revision ) noexcept {
+         auto iter = std::partition_point(_undo_stack.begin(), _undo_stack.end(), [&](const undo_state& s) { return s.touch.revision <= revision; });
+         if (iter == _undo_stack.end()) {
+            expire(_old_values.begin(), _removed_values.begin(), _field_values.begin());
+         } else if (iter != _undo_stack.begin()) {
+            expire(get_old_values_end(*iter), get_removed_values_end(*iter), get_field_values_end(*iter));
+         }
+         if (_clock_slot != no_clock_slot) {
+            for (auto i = _undo_stack.begin(); i != iter; ++i) _clock->unlink(i->touch);
+         }
+         _undo_stack.erase(_undo_stack.begin(), iter);
+         if (_undo_stack.empty()) {
+            trim_impl();
          }
-         squash_fast();
       }
 
       void compress_last_undo_session() noexcept {
-         compress_impl(_undo_stack.back());
+         if (has_current_undo_state()) {
+            compress_impl(_undo_stack.back());
+         }
       }
 
     private:
@@ -653,6 +1238,17 @@ namespace chainbase {
                                         return false;
                                      },
                                      [&](pointer p) { dispose_old(*p); });
+         remove_if_after_and_dispose(_field_values, _field_values.before_begin(), get_field_values_end(_undo_stack.back()),
+                                     [session_start](field_node& f){
+                                        if(f._mtime >= session_start) return true;
+                                        auto& item = f._current->_item;
+                                        if (get_removed_field(item) == erased_flag) {
+                                           std::memcpy(reinterpret_cast<char*>(&item) + f._offset, f._bytes, f._size);
+                                           return true;
+                                        }
+                                        return false;
+                                     },
+                                     [this](auto p) { dispose_field(*p); });
          remove_if_after_and_dispose(_removed_values, _removed_values.before_begin(), get_removed_values_end(_undo_stack.back()),
                                      [old_next_id](value_type& v){
                                         return v.id >= old_next_id;
@@ -660,20 +1256,52 @@ namespace chainbase {
                                      [this](pointer p) { dispose_node(*p); });
       }
 
-      // starts a new undo session.
+      // starts a new undo session.  The undo_state is pushed by the first write in the session.
+      int64_t add_session() noexcept {
+         return ++_clock->revision;
+      }
+
+      // Returns the undo_state of the current session, pushing it if this is the first write in the session,
+      // or nullptr if there is no session.  Every write calls this before changing anything, so afterwards
+      // the undo stack is empty exactly when there is no session.
       // Exception safety: strong
-      int64_t add_session() {
-         _undo_stack.emplace_back();
-         _undo_stack.back().old_values_end = _old_values.empty()?nullptr:&*_old_values.begin();
-         _undo_stack.back().removed_values_end = _removed_values.empty()?nullptr:&*_removed_values.begin();
-         _undo_stack.back().old_next_id = _next_id;
-         _undo_stack.back().ctime = ++_monotonic_revision;
-         return ++_revision;
+      undo_state* current_undo_state() {
+         if(!_clock->has_session()) return nullptr;
+         if(_undo_stack.empty() || _undo_stack.back().touch.revision != _clock->revision) {
+            _undo_stack.emplace_back();
+            _undo_stack.back().old_values_end = _old_values.empty()?nullptr:&*_old_values.begin();
+            _undo_stack.back().removed_values_end = _removed_values.empty()?nullptr:&*_removed_values.begin();
+            _undo_stack.back().field_values_end = _field_values.empty()?nullptr:&*_field_values.begin();
+            _undo_stack.back().old_next_id = _next_id;
+            _undo_stack.back().ctime = ++_monotonic_revision;
+            _undo_stack.back().touch.revision = _clock->revision;
+            _undo_stack.back().touch.slot = _clock_slot;
+            _undo_stack.back().records = undo_records();
+            _undo_stack.back().size = size();
+            if(_clock_slot != no_clock_slot) _clock->link(_undo_stack.back().touch);
+         }
+         return &_undo_stack.back();
+      }
+      // Whether the top of the undo stack belongs to the current session
+      bool has_current_undo_state() const {
+         return !_undo_stack.empty() && _undo_stack.back().touch.revision == _clock->revision;
+      }
+      void pop_undo_state() noexcept {
+         if(_clock_slot != no_clock_slot) _clock->unlink(_undo_stack.back().touch);
+         _undo_stack.pop_back();
       }
 
       template<int N = 0>
       bool insert_impl(value_type& p) {
-         if constexpr (N < sizeof...(Indices)) {
+         if constexpr (is_non_unique_at<N>()) {
+            auto iter = std::get<N>(_indices).insert_equal(p);
+            auto guard = scope_exit{[this,iter=iter]{ std::get<N>(_indices).erase(iter); }};
+            if(insert_impl<N+1>(p)) {
+               guard.cancel();
+               return true;
+            }
+            return false;
+         } else if constexpr (N < sizeof...(Indices)) {
             auto [iter, inserted] = std::get<N>(_indices).insert_unique(p);
             if(!inserted) return false;
             auto guard = scope_exit{[this,iter=iter]{ std::get<N>(_indices).erase(iter); }};
@@ -686,10 +1314,59 @@ namespace chainbase {
          return true;
       }
 
+      // Adds objects to every index but the first.  The ordered indices are built by appending the objects in
+      // sorted order when they all go after the existing ones.
+      template<int N = 1>
+      void bulk_insert_impl(std::vector<value_type*>& objects) {
+         if constexpr (N < sizeof...(Indices)) {
+            auto& idx = std::get<N>(_indices);
+            std::size_t inserted = 0;
+            auto guard = scope_exit{[&]{
+               for(std::size_t i = 0; i < inserted; ++i)
+                  idx.erase(idx.iterator_to(*objects[i]));
+            }};
+            auto fail = []{ BOOST_THROW_EXCEPTION( std::logic_error{ "could not insert object, most likely a uniqueness constraint was violated" } ); };
+            if constexpr (is_btree_at<N>() || is_hashed_at<N>()) {
+               for(; inserted < objects.size(); ++inserted)
+                  if(!idx.insert_unique(*objects[inserted]).second) fail();
+            } else {
+               auto less = [&](const value_type* lhs, const value_type* rhs) { return idx.value_comp()(*lhs, *rhs); };
+               // A unique index needs its keys strictly increasing
+               auto out_of_order = [&](const value_type* lhs, const value_type* rhs) {
+                  if constexpr (is_non_unique_at<N>()) return less(rhs, lhs);
+                  else return !less(lhs, rhs);
+               };
+               // Snapshots are usually in order already, which one pass confirms.  Sorted objects can only be out
+               // of order when a unique index has duplicates.
+               if(std::adjacent_find(objects.begin(), objects.end(), out_of_order) != objects.end()) {
+                  std::sort(objects.begin(), objects.end(), less);
+                  if(std::adjacent_find(objects.begin(), objects.end(), out_of_order) != objects.end()) fail();
+               }
+               if(idx.empty() || less(&*idx.rbegin(), objects.front())) {
+                  for(; inserted < objects.size(); ++inserted)
+                     idx.push_back(*objects[inserted]);
+               } else {
+                  for(; inserted < objects.size(); ++inserted) {
+                     if constexpr (is_non_unique_at<N>()) {
+                        idx.insert_equal(*objects[inserted]);
+                     } else if(!idx.insert_unique(*objects[inserted]).second) {
+                        fail();
+                     }
+                  }
+               }
+            }
+            bulk_insert_impl<N+1>(objects);
+            guard.cancel();
+         }
+      }
+
       // Moves a modified node into the correct location
       template<bool unique, int N = 0>
       bool post_modify(value_type& p) {
-         if constexpr (N < sizeof...(Indices)) {
+         if constexpr (is_btree_at<N>() || is_hashed_at<N>()) {
+            if(!std::get<N>(_indices).update(p, unique)) return false;
+            return post_modify<unique, N+1>(p);
+         } else if constexpr (N < sizeof...(Indices)) {
             auto& idx = std::get<N>(_indices);
             auto iter = idx.iterator_to(p);
             bool fixup = false;
@@ -705,7 +1382,7 @@ namespace chainbase {
             if(fixup) {
                auto iter2 = idx.iterator_to(p);
                idx.erase(iter2);
-               if constexpr (unique) {
+               if constexpr (unique && !is_non_unique_at<N>()) {
                   auto [new_pos, inserted] = idx.insert_unique(p);
                   if (!inserted) {
                      idx.insert_before(new_pos, p);
@@ -720,6 +1397,24 @@ namespace chainbase {
          return true;
       }
 
+      // Checks that a modify has not changed a key that any index but the first depends on
+      template<int N = 1>
+      bool is_in_place(const value_type& p) const {
+         if constexpr (N < sizeof...(Indices)) {
+            const auto& idx = std::get<N>(_indices);
+            if constexpr (is_btree_at<N>() || is_hashed_at<N>()) {
+               using key_from_value = typename boost::mp11::mp_at_c<boost::mp11::mp_list<Indices...>, N>::key_from_value_type;
+               if(idx.find(key_from_value{}(p)) != idx.iterator_to(p)) return false;
+            } else {
+               auto iter = idx.iterator_to(p);
+               if(iter != idx.begin() && !idx.value_comp()(*std::prev(iter), p)) return false;
+               if(++iter != idx.end() && !idx.value_comp()(p, *iter)) return false;
+            }
+            return is_in_place<N+1>(p);
+         }
+         return true;
+      }
+
       template<int N = 0>
       void erase_impl(value_type& p) {
          if constexpr (N < sizeof...(Indices)) {
@@ -737,9 +1432,8 @@ namespace chainbase {
       }
 
       value_type* on_modify( const value_type& obj) {
-         if (!_undo_stack.empty()) {
-            auto& undo_info = _undo_stack.back();
-            if ( to_node(obj)._mtime >= undo_info.ctime ) {
+         if (undo_state* state = current_undo_state()) {
+            if ( to_node(obj)._mtime >= state->ctime ) {
                // Nothing to do
             } else {
                // Not in removed_values
@@ -756,6 +1450,50 @@ namespace chainbase {
          }
          return nullptr;
       }
+      template<int N>
+      static constexpr bool is_btree_at() {
+         if constexpr (N < sizeof...(Indices)) {
+            return is_btree_index<boost::mp11::mp_at_c<boost::mp11::mp_list<Indices...>, N>>;
+         }
+         return false;
+      }
+      template<int N>
+      static constexpr bool is_non_unique_at() {
+         if constexpr (N < sizeof...(Indices)) {
+            return is_non_unique_index<boost::mp11::mp_at_c<boost::mp11::mp_list<Indices...>, N>>;
+         }
+         return false;
+      }
+      template<int N>
+      static constexpr bool is_hashed_at() {
+         if constexpr (N < sizeof...(Indices)) {
+            return is_hashed_index<boost::mp11::mp_at_c<boost::mp11::mp_list<Indices...>, N>>;
+         }
+         return false;
+      }
+      template<int N = 1>
+      std::size_t index_bytes_impl() const {
+         if constexpr(N < sizeof...(Indices)) {
+            if constexpr(is_btree_at<N>() || is_hashed_at<N>()) {
+               return std::get<N>(_indices).allocated_bytes() + index_bytes_impl<N+1>();
+            } else {
+               return index_bytes_impl<N+1>();
+            }
+         }
+         return 0;
+      }
+      // Lets btree indices give back the tree nodes that they no longer need
+      template<int N = 1>
+      void trim_impl() noexcept {
+         if constexpr(N < sizeof...(Indices)) {
+            if constexpr(is_btree_at<N>()) {
+               std::get<N>(_indices).trim();
+            }
+            trim_impl<N+1>();
+         }
+      }
+      template<typename Index, typename A>
+      static const A& index_arg(const A& a) { return a; }
       template<int N = 0>
       void clear_impl() noexcept {
          if constexpr(N < sizeof...(Indices)) {
@@ -779,16 +1517,73 @@ namespace chainbase {
       void dispose_old(value_type& node_ref) noexcept {
          dispose_old(static_cast<old_node&>(*boost::intrusive::get_parent_from_member(&node_ref, &value_holder<value_type>::_item)));
       }
-      void dispose(typename list_base<old_node, index0_type>::iterator old_start, typename list_base<node, index0_type>::iterator removed_start) noexcept {
-         // This will leave one element around.  That's okay, because we'll clean it up the next time.
-         if(old_start != _old_values.end())
-            _old_values.erase_after_and_dispose(old_start, _old_values.end(), [this](pointer p){ dispose_old(*p); });
-         if(removed_start != _removed_values.end())
-            _removed_values.erase_after_and_dispose(removed_start, _removed_values.end(), [this](pointer p){ dispose_node(*p); });
+      void dispose_field(field_node& node_ref) noexcept {
+         field_node* p{&node_ref};
+         field_alloc_traits::destroy(_field_values_allocator, p);
+         field_alloc_traits::deallocate(_field_values_allocator, p, 1);
       }
       void dispose_undo() noexcept {
          _old_values.clear_and_dispose([this](pointer p){ dispose_old(*p); });
          _removed_values.clear_and_dispose([this](pointer p){ dispose_node(*p); });
+         _field_values.clear_and_dispose([this](auto p){ dispose_field(*p); });
+         _old_values_expired = nullptr;
+         _removed_values_expired = nullptr;
+         _field_values_expired = nullptr;
+      }
+      // Marks the records from each start to the end of its list as belonging to committed sessions.  Records
+      // are only added at the front, and sessions are committed oldest first, so each start is at or before
+      // the records that are already marked.
+      void expire(typename list_base<old_node, index0_type>::iterator old_start, typename list_base<node, index0_type>::iterator removed_start,
+                  typename field_list_type::iterator field_start) noexcept {
+         if(old_start != _old_values.end())
+            _old_values_expired = &*old_start;
+         if(removed_start != _removed_values.end())
+            _removed_values_expired = &*removed_start;
+         if(field_start != _field_values.end())
+            _field_values_expired = &*field_start;
+      }
+      // Frees records after the first expired one.  That one may be the end of the oldest undo_state, so it
+      // is only freed once there are no undo_states.
+      template<typename List, typename Ptr, typename Disposer>
+      std::size_t reclaim_list(List& list, Ptr& expired, std::size_t max_records, Disposer&& disposer) noexcept {
+         if(!expired) return 0;
+         auto pos = list.iterator_to(*expired);
+         std::size_t done = 0;
+         for(; done < max_records && std::next(pos) != list.end(); ++done)
+            list.erase_after_and_dispose(pos, disposer);
+         if(done < max_records && _undo_stack.empty() && &list.front() == &*pos) {
+            list.pop_front_and_dispose(disposer);
+            expired = nullptr;
+            ++done;
+         }
+         return done;
+      }
+      // Saves size bytes at src, which are at offset in obj, for undo.
+      // Exception safety: basic.  Callers remove the field_nodes of a failed modify_fields.
+      void save_fields(const value_type& obj, std::size_t offset, const char* src, std::size_t size) {
+         for(std::size_t done = 0; done < size; done += field_node::capacity) {
+            auto p = field_alloc_traits::allocate(_field_values_allocator, 1);
+            field_alloc_traits::construct(_field_values_allocator, &*p);
+            p->_current = &to_node(obj);
+            p->_mtime = to_node(obj)._mtime;
+            p->_offset = offset + done;
+            p->_size = std::min(field_node::capacity, size - done);
+            std::memcpy(p->_bytes, src + done, p->_size);
+            _field_values.push_front(*p);
+         }
+      }
+      // Drops the field_nodes in front of end
+      void pop_fields(field_node* end) noexcept {
+         while(!_field_values.empty() && &_field_values.front() != end)
+            _field_values.pop_front_and_dispose([this](auto p){ dispose_field(*p); });
+      }
+      // Puts back the bytes in the field_nodes in front of end and drops them
+      void restore_fields(field_node* end) noexcept {
+         while(!_field_values.empty() && &_field_values.front() != end) {
+            field_node& f = _field_values.front();
+            std::memcpy(reinterpret_cast<char*>(&f._current->_item) + f._offset, f._bytes, f._size);
+            _field_values.pop_front_and_dispose([this](auto p){ dispose_field(*p); });
+         }
       }
       static node& to_node(value_type& obj) {
          return static_cast<node&>(*boost::intrusive::get_parent_from_member(&obj, &value_holder<value_type>::_item));
@@ -824,6 +1619,18 @@ namespace chainbase {
          return static_cast<decltype(_removed_values.cend())>(const_cast<undo_index*>(this)->get_removed_values_end(info));
       }
 
+      auto get_field_values_end(const undo_state& info) {
+         if(info.field_values_end == nullptr) {
+            return _field_values.end();
+         } else {
+            return _field_values.iterator_to(*info.field_values_end);
+         }
+      }
+
+      auto get_field_values_end(const undo_state& info) const {
+         return static_cast<decltype(_field_values.cend())>(const_cast<undo_index*>(this)->get_field_values_end(info));
+      }
+
       // returns true if the node should be destroyed
       bool on_remove( value_type& obj) {
          if (!_undo_stack.empty()) {
@@ -840,18 +1647,43 @@ namespace chainbase {
       }
       // Returns the field indicating whether the node has been removed
       static int& get_removed_field(const value_type& obj) {
-         return static_cast<hook<index0_type, Allocator>&>(to_node(obj))._color;
+         return static_cast<hook<T, index0_type>&>(to_node(obj))._color;
+      }
+      static constexpr uint32_t no_clock_slot = std::numeric_limits<uint32_t>::max();
+      static constexpr bool has_id_directory = use_id_directory<T>::value;
+      using id_directory_type = boost::container::deque<typename alloc_traits::pointer, rebind_alloc_t<Allocator, typename alloc_traits::pointer>>;
+      static auto make_id_directory(const Allocator& a) {
+         if constexpr (has_id_directory) {
+            return id_directory_type(a);
+         } else {
+            return std::tuple<>{};
+         }
+      }
+      void set_id_directory(const id_type& id, node* n) noexcept {
+         if constexpr (has_id_directory) {
+            _id_directory[id_directory_slot(id)] = n;
+         }
       }
-      using old_alloc_traits = typename std::allocator_traits<Allocator>::template rebind_traits<old_node>;
+      using old_alloc_traits = std::allocator_traits<undo_record_allocator_t<Allocator, old_node>>;
+      using field_alloc_traits = std::allocator_traits<undo_record_allocator_t<Allocator, field_node>>;
       indices_type _indices;
       boost::container::deque<undo_state, rebind_alloc_t<Allocator, undo_state>> _undo_stack;
       list_base<old_node, index0_type> _old_values;
       list_base<node, index0_type> _removed_values;
+      field_list_type _field_values;
+      // The first of the records of committed sessions that reclaim has not freed yet
+      typename std::allocator_traits<Allocator>::pointer _old_values_expired{};
+      typename std::allocator_traits<Allocator>::pointer _removed_values_expired{};
+      typename std::allocator_traits<undo_record_allocator_t<Allocator, field_node>>::pointer _field_values_expired{};
       rebind_alloc_t<Allocator, node> _allocator;
-      rebind_alloc_t<Allocator, old_node> _old_values_allocator;
+      undo_record_allocator_t<Allocator, old_node> _old_values_allocator;
+      undo_record_allocator_t<Allocator, field_node> _field_values_allocator;
       id_type _next_id = 0;
-      int64_t _revision = 0;
+      undo_clock _own_clock;
+      boost::interprocess::offset_ptr<undo_clock> _clock{&_own_clock};
+      uint32_t _clock_slot = no_clock_slot;
       uint64_t _monotonic_revision = 0;
+      std::conditional_t<has_id_directory, id_directory_type, std::tuple<>> _id_directory;
       uint32_t                        _size_of_value_type = sizeof(node);
       uint32_t                        _size_of_this = sizeof(undo_index);
    };
@@ -10,9 +10,10 @@
 namespace chainbase {
 
    database::database(const bfs::path& dir, open_flags flags, uint64_t shared_file_size, bool allow_dirty,
-                      pinnable_mapped_file::map_mode db_map_mode, std::vector<std::string> hugepage_paths ) :
-      _db_file(dir, flags & database::read_write, shared_file_size, allow_dirty, db_map_mode, hugepage_paths),
-      _read_only(flags == database::read_only)
+                      pinnable_mapped_file::map_mode db_map_mode, std::vector<std::string> hugepage_paths, unsigned io_threads,
+                      bool transparent_huge_pages, pinnable_mapped_file::auto_grow_policy auto_grow ) :
+      database_base(dir, flags & database::read_write, shared_file_size, allow_dirty, db_map_mode, hugepage_paths, io_threads,
+                    transparent_huge_pages, auto_grow)
    {
    }
 
@@ -38,47 +39,124 @@ namespace chainbase {
    }
 #endif
 
+   abstract_index& database::touched_index( const undo_touch& touch )const
+   {
+      if( touch.slot >= _index_map.size() || !_index_map[ touch.slot ] )
+         BOOST_THROW_EXCEPTION( std::logic_error( "the index with type_id " + std::to_string( touch.slot ) +
+                                                  " has undo sessions but has not been added" ) );
+      return *_index_map[ touch.slot ];
+   }
+
+   void database::set_undo_executor( undo_executor executor, size_t min_parallel_records )
+   {
+      _undo_executor = std::move( executor );
+      _min_parallel_records = min_parallel_records;
+   }
+
+   template<typename Op>
+   void database::run_touched( Op&& op )
+   {
+      _parallel_indices.clear();
+      for( size_t i = 0; i < _touched_indices.size(); ++i ) {
+         if( _touched_indices[i]->session_records() >= _min_parallel_records )
+            _parallel_indices.push_back( i );
+         else
+            op( i );
+      }
+      if( _parallel_indices.size() == 1 )
+         op( _parallel_indices.front() );
+      else if( _parallel_indices.size() > 1 )
+         _undo_executor( _parallel_indices.size(), [&]( size_t i ) { op( _parallel_indices[i] ); } );
+   }
+
+   // Only the indices written in a session have an undo_state for it, linked to the clock in order of revision.
+   // With an executor, the undo_states to process are unlinked up front, since the indices would otherwise
+   // race to unlink them, and each index is then processed on its own. Looking them up first also leaves
+   // everything unchanged when one is missing; touched_index() throws for it.
    void database::undo()
    {
-      for( auto& item : _index_list )
-      {
-         item->undo();
+      if( !_undo_executor )
+         return database_base::undo();
+      if( !_clock || !_clock->has_session() )
+         return;
+      _touches.clear();
+      _touched_indices.clear();
+      for( undo_touch* touch = _clock->newest.get(); touch && touch->revision == _clock->revision; touch = touch->prev.get() ) {
+         _touches.push_back( touch );
+         _touched_indices.push_back( &touched_index( *touch ) );
       }
+      for( undo_touch* touch : _touches )
+         _clock->unlink( *touch );
+      run_touched( [this]( size_t i ) { _touched_indices[i]->undo_touched(); } );
+      --_clock->revision;
    }
 
    void database::squash()
    {
-      for( auto& item : _index_list )
-      {
-         item->squash();
+      if( !_undo_executor )
+         return database_base::squash();
+      if( !_clock || !_clock->has_session() )
+         return;
+      _touches.clear();
+      _touched_indices.clear();
+      for( undo_touch* touch = _clock->newest.get(); touch && touch->revision == _clock->revision; touch = touch->prev.get() ) {
+         _touches.push_back( touch );
+         _touched_indices.push_back( &touched_index( *touch ) );
+      }
+      for( undo_touch* touch : _touches )
+         _clock->unlink( *touch );
+      _relabeled.assign( _touches.size(), false );
+      run_touched( [this]( size_t i ) { _relabeled[i] = _touched_indices[i]->squash_touched(); } );
+      // Relabeled undo_states move to the previous session, whose undo_states are all older.
+      for( size_t i = _touches.size(); i-- > 0; ) {
+         if( _relabeled[i] )
+            _clock->link( *_touches[i] );
       }
+      --_clock->revision;
    }
 
-   void database::commit( int64_t revision )
+   size_t database::reclaim_undo( size_t max_records )
    {
-      for( auto& item : _index_list )
-      {
-         item->commit( revision );
+      size_t done = 0;
+      while( !_reclaim_queue.empty() && done < max_records ) {
+         size_t n = _reclaim_queue.front()->reclaim( max_records - done );
+         if( n < max_records - done )
+            _reclaim_queue.erase( _reclaim_queue.begin() );
+         done += n;
       }
+      return done;
    }
 
-   void database::undo_all()
+   void database::copy_into( database& dest )const
    {
-      for( auto& item : _index_list )
-      {
-         item->undo_all();
+      if( dest._read_only )
+         BOOST_THROW_EXCEPTION( std::logic_error( "cannot copy into a read only database" ) );
+      // dest is grown before each index, as bulk_load does, by the nodes and index structures of the copy plus
+      // whatever memory of the source is not accounted to any index, such as what objects allocate themselves
+      size_t in_indices = 0;
+      for( const auto& item : _index_list ) {
+         const undo_index_memory_stats stats = item->memory_stats();
+         in_indices += stats.node_bytes + stats.freelist_bytes + stats.old_values_bytes + stats.removed_values_bytes +
+                       stats.field_values_bytes + stats.index_bytes;
+      }
+      const size_t in_use = _db_file.get_size() - get_free_memory();
+      const size_t outside_indices = in_use > in_indices ? in_use - in_indices : 0;
+      for( const auto& item : _index_list ) {
+         if( dest._index_map.size() <= item->type_id() || !dest._index_map[ item->type_id() ] ||
+             dest._index_map[ item->type_id() ]->type_name() != item->type_name() )
+            BOOST_THROW_EXCEPTION( std::logic_error( "destination database has no index for " + item->type_name() ) );
+         const undo_index_memory_stats stats = item->memory_stats();
+         dest._db_file.grow_if_needed( stats.node_bytes + stats.index_bytes + outside_indices );
+         item->copy_into( *dest._index_map[ item->type_id() ] );
       }
    }
 
    database::session database::start_undo_session( bool enabled )
    {
-      if( enabled ) {
-         vector< std::unique_ptr<abstract_session> > _sub_sessions;
-         _sub_sessions.reserve( _index_list.size() );
-         for( auto& item : _index_list ) {
-            _sub_sessions.push_back( item->start_undo_session( enabled ) );
-         }
-         return session( std::move( _sub_sessions ) );
+      _db_file.grow_if_needed();
+      if( enabled && _clock ) {
+         ++_clock->revision;
+         return session( *this );
       } else {
          return session();
       }
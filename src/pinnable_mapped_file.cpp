@@ -3,15 +3,136 @@
 #include <boost/interprocess/managed_external_buffer.hpp>
 #include <boost/interprocess/anonymous_shared_memory.hpp>
 #include <boost/asio/signal_set.hpp>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <thread>
 
 #ifdef __linux__
 #include <sys/vfs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/syscall.h>
 #include <linux/magic.h>
+#include <linux/fs.h>
+#include <linux/userfaultfd.h>
+
+//Async write-protect faults and PAGEMAP_SCAN are Linux 6.7+; the ABI is stable so allow building against older headers
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#define UFFD_FEATURE_WP_UNPOPULATED (1<<13)
+#endif
+#ifndef UFFD_FEATURE_WP_ASYNC
+#define UFFD_FEATURE_WP_ASYNC (1<<15)
+#endif
+#ifndef UFFDIO_COPY_MODE_WP
+#define UFFDIO_COPY_MODE_WP ((__u64)1<<1)
+#endif
+#ifndef PAGEMAP_SCAN
+struct page_region {
+   __u64 start;
+   __u64 end;
+   __u64 categories;
+};
+struct pm_scan_arg {
+   __u64 size;
+   __u64 flags;
+   __u64 start;
+   __u64 end;
+   __u64 walk_end;
+   __u64 vec;
+   __u64 vec_len;
+   __u64 max_pages;
+   __u64 category_inverted;
+   __u64 category_mask;
+   __u64 category_anyof_mask;
+   __u64 return_mask;
+};
+#define PM_SCAN_WP_MATCHING (1<<0)
+#define PAGE_IS_WRITTEN     (1<<1)
+#define PAGEMAP_SCAN        _IOWR('f', 16, struct pm_scan_arg)
+#endif
+#endif
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define CHAINBASE_X86_ZERO_SCAN
 #endif
 
 namespace chainbase {
 
+// Calls fn(offset, length) for every stripe of a region of the given size. Stripes are handed out to
+// num_threads threads, one of which is the calling thread. Between its own stripes the calling thread
+// calls on_progress(bytes_done) so that signal handling and progress reporting stay on the thread that
+// owns them. The first exception thrown by any thread stops the remaining work and is rethrown here.
+template<typename F, typename P>
+static void for_each_stripe(size_t size, size_t stripe_size, unsigned num_threads, F&& fn, P&& on_progress) {
+   std::atomic<size_t> next_offset{0};
+   std::atomic<size_t> bytes_done{0};
+   std::atomic<bool>   stop{false};
+   std::exception_ptr  worker_exception;
+   std::mutex          worker_exception_mutex;
+
+   auto do_stripe = [&]() {
+      size_t offset = next_offset.fetch_add(stripe_size);
+      if(offset >= size)
+         return false;
+      size_t len = std::min(stripe_size, size - offset);
+      fn(offset, len);
+      bytes_done += len;
+      return true;
+   };
+
+   std::vector<std::thread> workers;
+   auto join_workers = [&]() {
+      stop = true;
+      for(std::thread& t : workers)
+         t.join();
+      workers.clear();
+   };
+
+   try {
+      for(unsigned i = 1; i < num_threads; ++i) {
+         workers.emplace_back([&]() {
+            try {
+               while(!stop && do_stripe());
+            }
+            catch(...) {
+               std::lock_guard<std::mutex> g(worker_exception_mutex);
+               if(!worker_exception)
+                  worker_exception = std::current_exception();
+               stop = true;
+            }
+         });
+      }
+      while(!stop && do_stripe())
+         on_progress(bytes_done.load());
+      // Keep servicing the caller while the workers finish up their last stripes
+      while(!stop && bytes_done.load() < size) {
+         on_progress(bytes_done.load());
+         std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+   }
+   catch(...) {
+      join_workers();
+      throw;
+   }
+   join_workers();
+   if(worker_exception)
+      std::rethrow_exception(worker_exception);
+}
+
 const char* chainbase_error_category::name() const noexcept {
    return "chainbase";
 }
@@ -44,6 +165,8 @@ std::string chainbase_error_category::message(int ev) const {
 	 return "Database load aborted";
       case db_error_code::no_mlock:
 	 return "Failed to mlock database";
+      case db_error_code::no_auto_grow:
+	 return "Automatic database growth not supported with hugetlbfs pages or on win32";
       default:
          return "Unrecognized error code";
    }
@@ -55,15 +178,26 @@ const std::error_category& chainbase_error_category() {
 }
 
 pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable, uint64_t shared_file_size, bool allow_dirty,
-                                          map_mode mode, std::vector<std::string> hugepage_paths) :
+                                          map_mode mode, std::vector<std::string> hugepage_paths, unsigned io_threads,
+                                          bool transparent_huge_pages, auto_grow_policy auto_grow) :
    _data_file_path(bfs::absolute(dir/"shared_memory.bin")),
    _database_name(dir.filename().string()),
-   _writable(writable)
+   _writable(writable),
+   _map_mode(mode),
+   _io_threads(io_threads),
+   _auto_grow(writable ? auto_grow : auto_grow_policy())
 {
-   if(shared_file_size % _db_size_multiple_requirement) {
+   if(shared_file_size % _db_size_multiple_requirement || _auto_grow.increment % _db_size_multiple_requirement ||
+      _auto_grow.max_size % _db_size_multiple_requirement) {
       std::string what_str("Database must be mulitple of " + std::to_string(_db_size_multiple_requirement) + " bytes");
       BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::bad_size), what_str));
    }
+#ifdef _WIN32
+   if(_auto_grow.increment)
+#else
+   if(_auto_grow.increment && hugepage_paths.size())
+#endif
+      BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::no_auto_grow)));
 #ifndef __linux__
    if(hugepage_paths.size())
       BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::no_huge_page)));
@@ -143,6 +277,14 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
          file_mapped_segment_manager = reinterpret_cast<segment_manager*>((char*)_file_mapped_region.get_address()+header_size);
    }
 
+   _size = _file_mapped_region.get_size();
+   _auto_grow.max_size = std::max<uint64_t>(_auto_grow.max_size, _size);
+   if(_auto_grow.increment && mode == mapped) {
+      //map past the end of the file up to max_size so growing never has to move the mapping
+      _file_mapped_region = bip::mapped_region(_file_mapping, bip::read_write, 0, _auto_grow.max_size);
+      file_mapped_segment_manager = reinterpret_cast<segment_manager*>((char*)_file_mapped_region.get_address()+header_size);
+   }
+
    if(_writable) {
       //remove meta file created in earlier versions
       boost::system::error_code ec;
@@ -156,6 +298,8 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
    }
 
    if(mode == mapped) {
+      if(transparent_huge_pages)
+         std::cerr << "CHAINBASE: Transparent huge pages are not used for database \"" << _database_name << "\" in mapped mode" << std::endl;
       _segment_manager = file_mapped_segment_manager;
    }
    else {
@@ -169,16 +313,17 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
       });
 
       try {
-         if(mode == heap)
-            _mapped_region = bip::mapped_region(bip::anonymous_shared_memory(_file_mapped_region.get_size()));
+         if(mode == heap || mode == lazy_heap || (transparent_huge_pages && hugepage_paths.empty()))
+            _mapped_region = get_anonymous_region(std::max<uint64_t>(_auto_grow.max_size, _size), transparent_huge_pages);
          else
             _mapped_region = get_huge_region(hugepage_paths);
 
-         load_database_file(sig_ios);
+         if(mode != lazy_heap || !start_lazy_load())
+            load_database_file(sig_ios);
 
          if(mode == locked) {
 #ifndef _WIN32
-            if(mlock(_mapped_region.get_address(), _mapped_region.get_size())) {
+            if(mlock(_mapped_region.get_address(), _size)) {
                std::string what_str("Failed to mlock database \"" + _database_name + "\"");
                BOOST_THROW_EXCEPTION(std::system_error(make_error_code(db_error_code::no_mlock), what_str));
 	       }
@@ -186,6 +331,13 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
 #endif
          }
 
+         if(transparent_huge_pages && !_lazy_loader)
+            std::cerr << "CHAINBASE: " << transparent_huge_page_bytes()/(1024*1024) << " of " << _size/(1024*1024)
+                      << " MiB of database \"" << _database_name << "\" is backed by transparent huge pages" << std::endl;
+
+         if(_writable && !_lazy_loader)
+            start_dirty_tracking();
+
          _file_mapped_region = bip::mapped_region();
       }
       catch(...) {
@@ -198,6 +350,55 @@ pinnable_mapped_file::pinnable_mapped_file(const bfs::path& dir, bool writable,
    }
 }
 
+// Transparent huge pages only back private anonymous memory unless shmem_enabled is set in
+// /sys/kernel/mm/transparent_hugepage, so asking for them gets a private mapping rather than anonymous shared memory.
+bip::mapped_region pinnable_mapped_file::get_anonymous_region(size_t size, bool transparent_huge_pages) {
+#ifdef __linux__
+   if(transparent_huge_pages) {
+      //with MAP_ANONYMOUS the file is ignored; it only gives mapped_region something to map
+      bip::file_mapping zero("/dev/zero", bip::read_write);
+      bip::mapped_region region(zero, bip::copy_on_write, 0, size, nullptr, MAP_ANONYMOUS);
+      if(madvise(region.get_address(), region.get_size(), MADV_HUGEPAGE))
+         std::cerr << "CHAINBASE: Database \"" << _database_name << "\" could not request transparent huge pages: " << strerror(errno) << std::endl;
+      return region;
+   }
+#else
+   if(transparent_huge_pages)
+      std::cerr << "CHAINBASE: Transparent huge pages are not supported on this platform" << std::endl;
+#endif
+   return bip::mapped_region(bip::anonymous_shared_memory(size));
+}
+
+size_t pinnable_mapped_file::transparent_huge_page_bytes() const {
+   size_t bytes = 0;
+#ifdef __linux__
+   const bip::mapped_region& region = _mapped_region.get_address() ? _mapped_region : _file_mapped_region;
+   const uintptr_t begin = (uintptr_t)region.get_address();
+   const uintptr_t end = begin + region.get_size();
+   std::ifstream smaps("/proc/self/smaps");
+   std::string line;
+   bool in_region = false;
+   while(std::getline(smaps, line)) {
+      uintptr_t vma_begin, vma_end;
+      char dash;
+      std::istringstream ls(line);
+      if(line.find(':') > line.find(' ') && ls >> std::hex >> vma_begin >> dash >> vma_end && dash == '-') {
+         in_region = vma_begin < end && vma_end > begin;
+         continue;
+      }
+      if(!in_region)
+         continue;
+      std::string field;
+      size_t kb;
+      ls.clear();
+      ls.seekg(0);
+      if(ls >> field >> std::dec >> kb && (field == "AnonHugePages:" || field == "ShmemPmdMapped:" || field == "FilePmdMapped:"))
+         bytes += kb*1024;
+   }
+#endif
+   return bytes;
+}
+
 bip::mapped_region pinnable_mapped_file::get_huge_region(const std::vector<std::string>& huge_paths) {
    std::map<unsigned, std::string> page_size_to_paths;
    const auto mapped_file_size = _file_mapped_region.get_size();
@@ -229,95 +430,667 @@ bip::mapped_region pinnable_mapped_file::get_huge_region(const std::vector<std::
 #endif
 
    std::cerr << "CHAINBASE: Database \"" << _database_name << "\" not using huge pages" << std::endl;
-   return bip::mapped_region(bip::anonymous_shared_memory(mapped_file_size));
+   return get_anonymous_region(std::max<uint64_t>(_auto_grow.max_size, mapped_file_size), false);
 }
 
 void pinnable_mapped_file::load_database_file(boost::asio::io_service& sig_ios) {
    std::cerr << "CHAINBASE: Preloading \"" << _database_name << "\" database file, this could take a moment..." << std::endl;
-   char* const src = (char*)_file_mapped_region.get_address();
    char* const dst = (char*)_mapped_region.get_address();
-   size_t offset = 0;
+   const size_t size = _file_mapped_region.get_size();
+#ifndef _WIN32
+   const int fd = _file_mapping.get_mapping_handle().handle;
+#else
+   char* const src = (char*)_file_mapped_region.get_address();
+#endif
    time_t t = time(nullptr);
-   while(offset != _file_mapped_region.get_size()) {
-      memcpy(dst+offset, src+offset, _db_size_multiple_requirement);
-      offset += _db_size_multiple_requirement;
-
+   for_each_stripe(size, _io_stripe_size, _io_threads, [&](size_t offset, size_t len) {
+#ifndef _WIN32
+      // Read straight into the destination; the kernel's copy out of the page cache is the only copy made
+      while(len) {
+         ssize_t r = pread(fd, dst+offset, len, offset);
+         if(r < 0 && errno == EINTR)
+            continue;
+         if(r <= 0) {
+            std::string what_str("Failed to read database file \"" + _database_name + "\": " + (r ? std::string(strerror(errno)) : std::string("unexpected end of file")));
+            BOOST_THROW_EXCEPTION(std::runtime_error(what_str));
+         }
+         offset += r;
+         len -= r;
+      }
+#else
+      memcpy(dst+offset, src+offset, len);
+#endif
+   }, [&](size_t done) {
       if(time(nullptr) != t) {
          t = time(nullptr);
-         std::cerr << "              " << offset/(_file_mapped_region.get_size()/100) << "% complete..." << std::endl;
+         std::cerr << "              " << done/(size/100) << "% complete..." << std::endl;
       }
       sig_ios.poll();
-   }
+   });
    std::cerr << "           Complete" << std::endl;
 }
 
-bool pinnable_mapped_file::all_zeros(char* data, size_t sz) {
-   uint64_t* p = (uint64_t*)data;
-   uint64_t* end = p+sz/sizeof(uint64_t);
+static bool all_zeros_scalar(const char* data, size_t sz) {
+   const uint64_t* p = (const uint64_t*)data;
+   const uint64_t* end = p+sz/sizeof(uint64_t);
    while(p != end) {
       if(*p++ != 0)
          return false;
    }
+   for(const char* c = (const char*)end; c != data+sz; ++c)
+      if(*c)
+         return false;
    return true;
 }
 
-void pinnable_mapped_file::save_database_file() {
-   std::cerr << "CHAINBASE: Writing \"" << _database_name << "\" database file, this could take a moment..." << std::endl;
-   char* src = (char*)_mapped_region.get_address();
-   char* dst = (char*)_file_mapped_region.get_address();
-   size_t offset = 0;
-   time_t t = time(nullptr);
-   while(offset != _file_mapped_region.get_size()) {
-      if(!all_zeros(src+offset, _db_size_multiple_requirement))
-         memcpy(dst+offset, src+offset, _db_size_multiple_requirement);
-      offset += _db_size_multiple_requirement;
+#ifdef CHAINBASE_X86_ZERO_SCAN
+// Both vector scans OR together 128 bytes per iteration and bail out on the first non-zero block,
+// leaving any remainder to the scalar scan.
+__attribute__((target("avx2")))
+static bool all_zeros_avx2(const char* data, size_t sz) {
+   const char* const end = data + sz/128*128;
+   for(const char* p = data; p != end; p += 128) {
+      __m256i acc = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256((const __m256i*)p),      _mm256_loadu_si256((const __m256i*)(p+32))),
+                                    _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(p+64)), _mm256_loadu_si256((const __m256i*)(p+96))));
+      if(!_mm256_testz_si256(acc, acc))
+         return false;
+   }
+   return all_zeros_scalar(end, data+sz-end);
+}
 
-      if(time(nullptr) != t) {
+static bool all_zeros_sse2(const char* data, size_t sz) {
+   const char* const end = data + sz/128*128;
+   for(const char* p = data; p != end; p += 128) {
+      __m128i acc = _mm_setzero_si128();
+      for(unsigned i = 0; i < 128; i += 16)
+         acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*)(p+i)));
+      if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+         return false;
+   }
+   return all_zeros_scalar(end, data+sz-end);
+}
+#endif
+
+bool pinnable_mapped_file::all_zeros(const char* data, size_t sz) {
+#ifdef CHAINBASE_X86_ZERO_SCAN
+   static bool (*const impl)(const char*, size_t) = __builtin_cpu_supports("avx2") ? all_zeros_avx2 : all_zeros_sse2;
+   return impl(data, sz);
+#else
+   return all_zeros_scalar(data, sz);
+#endif
+}
+
+// Write-protects the freshly loaded region in async mode: the kernel resolves write faults itself and
+// just records which pages were written, so tracking costs one minor fault per page per save.
+void pinnable_mapped_file::start_dirty_tracking() {
+#ifdef __linux__
+   int fd = syscall(SYS_userfaultfd, O_CLOEXEC|O_NONBLOCK);
+   if(fd < 0)
+      fd = syscall(SYS_userfaultfd, O_CLOEXEC|O_NONBLOCK|UFFD_USER_MODE_ONLY);
+   if(fd < 0)
+      return;
+
+   uffdio_api api = {};
+   api.api = UFFD_API;
+   api.features = UFFD_FEATURE_WP_ASYNC|UFFD_FEATURE_WP_UNPOPULATED;
+   uffdio_register reg = {};
+   reg.range = {(__u64)_mapped_region.get_address(), _mapped_region.get_size()};
+   reg.mode = UFFDIO_REGISTER_MODE_WP;
+   uffdio_writeprotect wp = {};
+   wp.range = reg.range;
+   wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+   if(ioctl(fd, UFFDIO_API, &api) || ioctl(fd, UFFDIO_REGISTER, &reg) || ioctl(fd, UFFDIO_WRITEPROTECT, &wp)) {
+      close(fd);
+      return;
+   }
+   _dirty_tracking_fd = fd;
+#endif
+}
+
+void pinnable_mapped_file::stop_dirty_tracking() {
+#ifdef __linux__
+   if(_dirty_tracking_fd >= 0)
+      close(_dirty_tracking_fd);
+   _dirty_tracking_fd = -1;
+#endif
+}
+
+struct pinnable_mapped_file::lazy_loader {
+   lazy_loader(char* base, size_t size, int file_fd, int uffd, bool write_protect, std::string name) :
+      base(base), num_chunks(size/_db_size_multiple_requirement), file_fd(file_fd), uffd(uffd), write_protect(write_protect),
+      name(std::move(name)), filled(new std::atomic<bool>[num_chunks]) {
+      for(size_t i = 0; i < num_chunks; ++i)
+         filled[i] = false;
+      thread = std::thread([this]() { run(); });
+   }
+
+   ~lazy_loader() {
+      stop_and_join();
+#ifdef __linux__
+      close(uffd);
+#endif
+   }
+
+   bool complete() const { return done.load(); }
+
+   void stop_and_join() {
+      stop = true;
+      if(thread.joinable())
+         thread.join();
+   }
+
+   // Page faults are served ahead of streaming so that the database is usable while it is still loading
+   void run() {
+      size_t next = 0;
+      while(!stop) {
+         serve_faults();
+         while(next != num_chunks && filled[next])
+            ++next;
+         if(next == num_chunks)
+            break;
+         fill(next);
+      }
+      if(next == num_chunks) {
+         done = true;
+         std::cerr << "CHAINBASE: Database \"" << name << "\" has been fully loaded in to memory" << std::endl;
+      }
+   }
+
+   void serve_faults() {
+#ifdef __linux__
+      pollfd pfd = {uffd, POLLIN, 0};
+      while(poll(&pfd, 1, 0) > 0) {
+         uffd_msg msgs[16];
+         ssize_t r = read(uffd, msgs, sizeof(msgs));
+         if(r < 0 && (errno == EAGAIN || errno == EINTR))
+            continue;
+         if(r <= 0)
+            fatal(std::string("reading page faults failed: ") + strerror(errno));
+         for(size_t i = 0; i < r/sizeof(uffd_msg); ++i) {
+            if(msgs[i].event != UFFD_EVENT_PAGEFAULT)
+               continue;
+            const size_t offset = msgs[i].arg.pagefault.address - (uintptr_t)base;
+            const size_t chunk = offset/_db_size_multiple_requirement;
+            if(!filled[chunk])
+               fill(chunk);
+            else {
+               //raced with the chunk being filled; the faulting thread still needs to be woken
+               uffdio_range range = {(__u64)base + chunk*_db_size_multiple_requirement, _db_size_multiple_requirement};
+               ioctl(uffd, UFFDIO_WAKE, &range);
+            }
+         }
+      }
+#endif
+   }
+
+   void fill(size_t chunk) {
+#ifdef __linux__
+      const size_t offset = chunk*_db_size_multiple_requirement;
+      for(size_t done_bytes = 0; done_bytes != _db_size_multiple_requirement;) {
+         ssize_t r = pread(file_fd, buffer.get()+done_bytes, _db_size_multiple_requirement-done_bytes, offset+done_bytes);
+         if(r < 0 && errno == EINTR)
+            continue;
+         if(r <= 0)
+            fatal(std::string("reading database file failed: ") + (r ? strerror(errno) : "unexpected end of file"));
+         done_bytes += r;
+      }
+      const size_t page_size = sysconf(_SC_PAGESIZE);
+      for(size_t copied = 0; copied != _db_size_multiple_requirement;) {
+         uffdio_copy copy = {};
+         copy.dst = (__u64)base + offset + copied;
+         copy.src = (__u64)buffer.get() + copied;
+         copy.len = _db_size_multiple_requirement - copied;
+         copy.mode = write_protect ? UFFDIO_COPY_MODE_WP : 0;
+         if(ioctl(uffd, UFFDIO_COPY, &copy) == 0) {
+            copied += copy.len;
+            continue;
+         }
+         if(copy.copy > 0)
+            copied += copy.copy;
+         else if(errno == EEXIST)
+            copied += page_size;
+         else if(errno != EAGAIN && errno != EINTR)
+            fatal(std::string("populating database memory failed: ") + strerror(errno));
+      }
+#endif
+      filled[chunk] = true;
+   }
+
+   // Threads faulting on the database would otherwise wait forever
+   [[noreturn]] void fatal(const std::string& what) {
+      std::cerr << "CHAINBASE: ERROR: lazily loading \"" << name << "\" database: " << what << std::endl;
+      std::abort();
+   }
+
+   char* const                          base;
+   const size_t                         num_chunks;
+   const int                            file_fd;
+   const int                            uffd;
+   const bool                           write_protect;
+   const std::string                    name;
+   std::unique_ptr<std::atomic<bool>[]> filled;
+   std::unique_ptr<char[]>              buffer{new char[_db_size_multiple_requirement]};
+   std::atomic<bool>                    stop{false};
+   std::atomic<bool>                    done{false};
+   std::thread                          thread;
+};
+
+// Registers the empty heap region for missing page faults and starts filling it. When writable the same userfaultfd
+// also tracks modified pages: chunks are populated write protected, as start_dirty_tracking() would leave them.
+// Returns false, leaving the region untouched, when userfaultfd is unavailable.
+bool pinnable_mapped_file::start_lazy_load() {
+#ifdef __linux__
+   const __u64 base = (__u64)_mapped_region.get_address();
+   const __u64 size = _size;
+   const __u64 reserved = _mapped_region.get_size();
+   for(bool write_protect : {_writable, false}) {
+      int fd = syscall(SYS_userfaultfd, O_CLOEXEC|O_NONBLOCK);
+      if(fd < 0)
+         fd = syscall(SYS_userfaultfd, O_CLOEXEC|O_NONBLOCK|UFFD_USER_MODE_ONLY);
+      if(fd < 0)
+         break;
+
+      uffdio_api api = {};
+      api.api = UFFD_API;
+      api.features = UFFD_FEATURE_MISSING_SHMEM | (write_protect ? UFFD_FEATURE_WP_ASYNC|UFFD_FEATURE_WP_UNPOPULATED : 0);
+      uffdio_register reg = {};
+      reg.range = {base, size};
+      reg.mode = UFFDIO_REGISTER_MODE_MISSING | (write_protect ? UFFDIO_REGISTER_MODE_WP : 0);
+      //room left for growth holds no file contents; it only needs its modifications tracked
+      uffdio_register grow_reg = {};
+      grow_reg.range = {base+size, reserved-size};
+      grow_reg.mode = UFFDIO_REGISTER_MODE_WP;
+      uffdio_writeprotect wp = {};
+      wp.range = {base, reserved};
+      wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+      if(ioctl(fd, UFFDIO_API, &api) || ioctl(fd, UFFDIO_REGISTER, &reg) ||
+         (write_protect && reserved != size && ioctl(fd, UFFDIO_REGISTER, &grow_reg)) ||
+         (write_protect && ioctl(fd, UFFDIO_WRITEPROTECT, &wp))) {
+         close(fd);
+         continue;
+      }
+      if(write_protect)
+         _dirty_tracking_fd = dup(fd);
+      _lazy_loader = std::make_unique<lazy_loader>((char*)base, size, _file_mapping.get_mapping_handle().handle, fd, write_protect, _database_name);
+      std::cerr << "CHAINBASE: Database \"" << _database_name << "\" is being loaded in to memory in the background" << std::endl;
+      return true;
+   }
+   std::cerr << "CHAINBASE: userfaultfd unavailable; loading \"" << _database_name << "\" in to memory up front" << std::endl;
+#endif
+   return false;
+}
+
+void pinnable_mapped_file::stop_lazy_load() {
+   _lazy_loader.reset();
+}
+
+// Chunks that were never loaded still match the file and must not be read: nothing would serve their page faults
+std::vector<char> pinnable_mapped_file::get_chunks_to_save(bool reprotect) {
+   std::vector<char> dirty = get_dirty_chunks(reprotect);
+   if(_lazy_loader && !_lazy_loader->complete()) {
+      if(dirty.empty())
+         dirty.assign(_size/_db_size_multiple_requirement, 1);
+      for(size_t i = 0; i < std::min(_lazy_loader->num_chunks, dirty.size()); ++i)
+         dirty[i] = dirty[i] && _lazy_loader->filled[i];
+   }
+   return dirty;
+}
+
+// Returns one flag per _db_size_multiple_requirement chunk of _mapped_region telling whether it was
+// written since start_dirty_tracking() or the last call with reprotect set. Empty when dirty pages are not
+// being tracked.
+std::vector<char> pinnable_mapped_file::get_dirty_chunks(bool reprotect) {
+   std::vector<char> dirty;
+#ifdef __linux__
+   if(_dirty_tracking_fd < 0)
+      return dirty;
+   int pagemap_fd = open("/proc/self/pagemap", O_RDONLY|O_CLOEXEC);
+   if(pagemap_fd < 0)
+      return dirty;
+
+   const __u64 base = (__u64)_mapped_region.get_address();
+   const __u64 end = base + _size;
+   dirty.resize(_size/_db_size_multiple_requirement);
+   page_region regions[256];
+   pm_scan_arg arg = {};
+   arg.size = sizeof(arg);
+   arg.flags = reprotect ? PM_SCAN_WP_MATCHING : 0;
+   arg.start = base;
+   arg.end = end;
+   arg.vec = (__u64)regions;
+   arg.vec_len = sizeof(regions)/sizeof(regions[0]);
+   arg.category_mask = PAGE_IS_WRITTEN;
+   arg.return_mask = PAGE_IS_WRITTEN;
+   while(arg.start < end) {
+      long n = ioctl(pagemap_fd, PAGEMAP_SCAN, &arg);
+      if(n < 0) {
+         //pages reported so far may have been protected again already, so there is no going back to tracking
+         if(reprotect)
+            stop_dirty_tracking();
+         dirty.clear();
+         break;
+      }
+      for(long i = 0; i < n; ++i)
+         for(__u64 c = (regions[i].start-base)/_db_size_multiple_requirement; c <= (regions[i].end-1-base)/_db_size_multiple_requirement; ++c)
+            dirty[c] = 1;
+      arg.start = arg.walk_end;
+   }
+   close(pagemap_fd);
+#endif
+   return dirty;
+}
+
+// Writes the chunks of _mapped_region flagged in dirty (every chunk when dirty is empty) to the database file without
+// syncing it. Throws on failure.
+void pinnable_mapped_file::write_database_file(const std::vector<char>& dirty, bool report_progress) {
+   const char* const src = (const char*)_mapped_region.get_address();
+   const size_t size = _size;
+   auto chunk_dirty = [&](size_t offset) { return dirty.empty() || dirty[offset/_db_size_multiple_requirement]; };
+#ifndef _WIN32
+   const int fd = _file_mapping.get_mapping_handle().handle;
+   std::atomic<bool> punch_supported{true};
+   auto write_range = [&](size_t offset, size_t len) {
+      while(len) {
+         ssize_t r = pwrite(fd, src+offset, len, offset);
+         if(r < 0 && errno == EINTR)
+            continue;
+         if(r <= 0)
+            BOOST_THROW_EXCEPTION(std::runtime_error(std::string("pwrite() failed: ") + strerror(errno)));
+         offset += r;
+         len -= r;
+      }
+   };
+   // Zero chunks become holes so stale bytes from an earlier save don't survive and the file system can
+   // release the blocks. File systems without hole punching get the zeros written out instead.
+   auto zero_range = [&](size_t offset, size_t len) {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+      if(punch_supported.load(std::memory_order_relaxed)) {
+         if(fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+            return;
+         if(errno != EOPNOTSUPP && errno != ENOSYS)
+            BOOST_THROW_EXCEPTION(std::runtime_error(std::string("fallocate() failed: ") + strerror(errno)));
+         punch_supported = false;
+      }
+#endif
+      write_range(offset, len);
+   };
+#else
+   char* const dst = (char*)_file_mapped_region.get_address();
+   auto write_range = [&](size_t offset, size_t len) { memcpy(dst+offset, src+offset, len); };
+   auto zero_range = [&](size_t offset, size_t len) { memset(dst+offset, 0, len); };
+#endif
+   time_t t = time(nullptr);
+   for_each_stripe(size, _io_stripe_size, _io_threads, [&](size_t offset, size_t len) {
+      // Coalesce runs of zero and non-zero chunks within the stripe into single calls; unmodified chunks
+      // already match the file and are skipped
+      const size_t end = offset + len;
+      // the chunk that ended the previous run has been scanned already
+      bool scanned = false;
+      bool next_zero = false;
+      while(offset != end) {
+         if(!chunk_dirty(offset)) {
+            offset += _db_size_multiple_requirement;
+            continue;
+         }
+         const bool zero = scanned ? next_zero : all_zeros(src+offset, _db_size_multiple_requirement);
+         scanned = false;
+         size_t run_end = offset + _db_size_multiple_requirement;
+         while(run_end != end && chunk_dirty(run_end)) {
+            next_zero = all_zeros(src+run_end, _db_size_multiple_requirement);
+            if(next_zero != zero) {
+               scanned = true;
+               break;
+            }
+            run_end += _db_size_multiple_requirement;
+         }
+         if(zero)
+            zero_range(offset, run_end - offset);
+         else
+            write_range(offset, run_end - offset);
+         offset = run_end;
+      }
+   }, [&](size_t done) {
+      if(report_progress && time(nullptr) != t) {
          t = time(nullptr);
-         std::cerr << "              " << offset/(_file_mapped_region.get_size()/100) << "% complete..." << std::endl;
+         std::cerr << "              " << done/(size/100) << "% complete..." << std::endl;
       }
+   });
+}
+
+bool pinnable_mapped_file::sync_database_file() {
+#ifndef _WIN32
+   return fsync(_file_mapping.get_mapping_handle().handle) == 0;
+#else
+   return _file_mapped_region.flush(0, 0, false);
+#endif
+}
+
+bool pinnable_mapped_file::save_database_file() {
+   const std::vector<char> dirty = get_chunks_to_save(false);
+   if(dirty.empty())
+      std::cerr << "CHAINBASE: Writing \"" << _database_name << "\" database file, this could take a moment..." << std::endl;
+   else
+      std::cerr << "CHAINBASE: Writing \"" << _database_name << "\" database file (" << std::count(dirty.begin(), dirty.end(), 1)
+                << " of " << dirty.size() << " MiB modified), this could take a moment..." << std::endl;
+   try {
+      write_database_file(dirty, true);
+   }
+   catch(const std::exception& e) {
+      std::cerr << "CHAINBASE: ERROR: writing \"" << _database_name << "\" database file failed: " << e.what() << std::endl;
+      return false;
    }
    std::cerr << "           Syncing buffers..." << std::endl;
-   if(_file_mapped_region.flush(0, 0, false) == false)
+   if(!sync_database_file()) {
       std::cerr << "CHAINBASE: ERROR: syncing buffers failed" << std::endl;
+      return false;
+   }
    std::cerr << "           Complete" << std::endl;
+   return true;
 }
 
-pinnable_mapped_file::pinnable_mapped_file(pinnable_mapped_file&& o) :
-   _mapped_file_lock(std::move(o._mapped_file_lock)),
-   _data_file_path(std::move(o._data_file_path)),
-   _database_name(std::move(o._database_name)),
-   _file_mapped_region(std::move(o._file_mapped_region)),
-   _mapped_region(std::move(o._mapped_region))
-{
+// In heap and locked modes the modified chunks are written to the file before returning, so the database must not be
+// modified while flush() runs; it may be modified as soon as flush() returns. Syncing the file to storage (or, in
+// mapped mode, syncing the mapping) completes on a background thread.
+std::future<void> pinnable_mapped_file::flush() {
+   wait_for_flush();
+
+   std::promise<void> done;
+   std::future<void> ret = done.get_future();
+   if(!_writable) {
+      done.set_value();
+      return ret;
+   }
+
+   if(_mapped_region.get_address()) { //in heap or locked mode
+      try {
+#ifdef _WIN32
+         if(!_file_mapped_region.get_address())
+            _file_mapped_region = bip::mapped_region(_file_mapping, bip::read_write);
+#endif
+         write_database_file(get_chunks_to_save(true), false);
+      }
+      catch(...) {
+         //chunks written since the last save may have been write protected again without making it to the file
+         stop_dirty_tracking();
+         done.set_exception(std::current_exception());
+         return ret;
+      }
+   }
+
+   _flush_thread = std::thread([this, done = std::move(done)]() mutable {
+      const bool synced = _mapped_region.get_address() ? sync_database_file() : _file_mapped_region.flush(0, 0, false);
+      if(synced)
+         done.set_value();
+      else
+         done.set_exception(std::make_exception_ptr(std::runtime_error("syncing \"" + _database_name + "\" database file failed")));
+   });
+   return ret;
+}
+
+void pinnable_mapped_file::wait_for_flush() {
+   if(_flush_thread.joinable())
+      _flush_thread.join();
+}
+
+// The mapping already spans max_size: in mapped mode extending the file makes the new pages accessible, while in heap
+// and locked modes the memory is already there and the file is only extended to keep it the same size.
+bool pinnable_mapped_file::grow() {
+   if(!_auto_grow.increment || _size >= _auto_grow.max_size)
+      return false;
+   const size_t new_size = std::min<uint64_t>(_size + _auto_grow.increment, _auto_grow.max_size);
+   try {
+      bfs::resize_file(_data_file_path, new_size);
+   }
+   catch(const std::exception& e) {
+      std::cerr << "CHAINBASE: ERROR: growing \"" << _database_name << "\" database file failed: " << e.what() << std::endl;
+      return false;
+   }
+#ifndef _WIN32
+   if(_map_mode == locked && mlock((char*)_mapped_region.get_address() + _size, new_size - _size)) {
+      std::cerr << "CHAINBASE: ERROR: failed to mlock grown part of database \"" << _database_name << "\"" << std::endl;
+      bfs::resize_file(_data_file_path, _size);
+      return false;
+   }
+#endif
+   _segment_manager->grow(new_size - _size);
+   _size = new_size;
+   std::cerr << "CHAINBASE: Database \"" << _database_name << "\" grown to " << _size/(1024*1024) << " MiB" << std::endl;
+   return true;
+}
+
+namespace {
+   // rbtree_best_fit offers no way to look at its free blocks. Explicit instantiations are exempt from access
+   // checking, which lets this one hand out a pointer to its private header.
+   using memory_algorithm = bip::rbtree_best_fit<bip::mutex_family>;
+   static_assert(std::is_base_of_v<memory_algorithm, pinnable_mapped_file::segment_manager>);
+
+   struct rbtree_header_tag { friend auto rbtree_header_member(rbtree_header_tag); };
+   template<auto Member>
+   struct expose_rbtree_header { friend auto rbtree_header_member(rbtree_header_tag) { return Member; } };
+   template struct expose_rbtree_header<&memory_algorithm::m_header>;
+}
+
+pinnable_mapped_file::segment_stats pinnable_mapped_file::get_segment_stats() const {
+   segment_stats stats;
+   //a C style cast can reach the private base
+   const auto& header = ((const memory_algorithm*)_segment_manager)->*rbtree_header_member(rbtree_header_tag{});
+   using header_mutex = bip::mutex_family::mutex_type;
+   static_assert(std::is_base_of_v<header_mutex, std::decay_t<decltype(header)>>);
+   //locking writes to the segment, which a read only database can't do; nothing else can change it then either
+   std::optional<bip::scoped_lock<header_mutex>> guard;
+   if(_writable)
+      guard.emplace(const_cast<header_mutex&>(static_cast<const header_mutex&>(header)));
+   stats.size = _segment_manager->get_size();
+   for(const auto& block : header.m_imultiset) {
+      const size_t bytes = block.m_size * memory_algorithm::Alignment;
+      stats.free_bytes += bytes;
+      ++stats.free_blocks;
+      stats.largest_free_block = std::max(stats.largest_free_block, bytes);
+      ++stats.free_block_histogram[63 - __builtin_clzll(bytes)];
+   }
+   return stats;
+}
+
+size_t pinnable_mapped_file::resident_bytes(const void* addr, size_t size) const {
+   size_t resident = 0;
+#ifndef _WIN32
+   const size_t page_size = bip::mapped_region::get_page_size();
+   const uintptr_t begin = (uintptr_t)addr / page_size * page_size;
+   const uintptr_t end = ((uintptr_t)addr + size + page_size - 1) / page_size * page_size;
+   std::vector<unsigned char> pages(1024);
+   for(uintptr_t p = begin; p < end; p += pages.size() * page_size) {
+      const size_t len = std::min<uintptr_t>(end - p, pages.size() * page_size);
+      if(mincore((void*)p, len, (decltype(&pages[0]))pages.data()))
+         return resident;
+      for(size_t i = 0; i < len / page_size; ++i)
+         resident += (pages[i] & 1) * page_size;
+   }
+#endif
+   return resident;
+}
+
+size_t pinnable_mapped_file::shrink_to_fit() {
+   if(!_writable)
+      return _size;
+   _segment_manager->shrink_to_fit();
+   const size_t used = header_size + _segment_manager->get_size();
+   const size_t new_size = std::min<size_t>(_size, (used + _db_size_multiple_requirement - 1) / _db_size_multiple_requirement * _db_size_multiple_requirement);
+   //hand the rounding back to the segment
+   _segment_manager->grow(new_size - used);
+   if(new_size != _size) {
+      bfs::resize_file(_data_file_path, new_size);
+      std::cerr << "CHAINBASE: Database \"" << _database_name << "\" shrunk from " << _size/(1024*1024) << " MiB to "
+                << new_size/(1024*1024) << " MiB" << std::endl;
+      _size = new_size;
+   }
+   return _size;
+}
+
+pinnable_mapped_file::pinnable_mapped_file(pinnable_mapped_file&& o) {
+   //the flush thread of o works on its regions, so it must be done before anything is moved out of o
+   o.wait_for_flush();
+   _mapped_file_lock = std::move(o._mapped_file_lock);
+   _data_file_path = std::move(o._data_file_path);
+   _database_name = std::move(o._database_name);
+   _file_mapping = std::move(o._file_mapping);
+   _file_mapped_region = std::move(o._file_mapped_region);
+   _mapped_region = std::move(o._mapped_region);
    _segment_manager = o._segment_manager;
    _writable = o._writable;
+   _map_mode = o._map_mode;
+   _io_threads = o._io_threads;
+   _auto_grow = o._auto_grow;
+   _size = o._size;
+   _dirty_tracking_fd = o._dirty_tracking_fd;
+   _lazy_loader = std::move(o._lazy_loader);
    o._writable = false; //prevent dtor from doing anything interesting
+   o._dirty_tracking_fd = -1;
 }
 
 pinnable_mapped_file& pinnable_mapped_file::operator=(pinnable_mapped_file&& o) {
+   wait_for_flush();
+   o.wait_for_flush();
+   stop_lazy_load();
+   stop_dirty_tracking();
    _mapped_file_lock = std::move(o._mapped_file_lock);
    _data_file_path = std::move(o._data_file_path);
    _database_name = std::move(o._database_name);
+   _file_mapping = std::move(o._file_mapping);
    _file_mapped_region = std::move(o._file_mapped_region);
    _mapped_region = std::move(o._mapped_region);
    _segment_manager = o._segment_manager;
    _writable = o._writable;
+   _map_mode = o._map_mode;
+   _io_threads = o._io_threads;
+   _auto_grow = o._auto_grow;
+   _size = o._size;
+   _dirty_tracking_fd = o._dirty_tracking_fd;
+   _lazy_loader = std::move(o._lazy_loader);
    o._writable = false; //prevent dtor from doing anything interesting
+   o._dirty_tracking_fd = -1;
    return *this;
 }
 
 pinnable_mapped_file::~pinnable_mapped_file() {
+   wait_for_flush();
    if(_writable) {
+      bool saved = true;
       if(_mapped_region.get_address()) { //in heap or locked mode
+         //the loader must be quiet so the set of loaded chunks can't change under the save
+         if(_lazy_loader)
+            _lazy_loader->stop_and_join();
          _file_mapped_region = bip::mapped_region(_file_mapping, bip::read_write);
-         save_database_file();
+         saved = save_database_file();
       }
       else
          if(_file_mapped_region.flush(0, 0, false) == false)
             std::cerr << "CHAINBASE: ERROR: syncing buffers failed" << std::endl;
-      set_mapped_file_db_dirty(false);
+      //a failed save leaves the dirty flag set; the file no longer matches what was in memory
+      if(saved)
+         set_mapped_file_db_dirty(false);
    }
+   stop_lazy_load();
+   stop_dirty_tracking();
 }
 
 void pinnable_mapped_file::set_mapped_file_db_dirty(bool dirty) {
@@ -335,6 +1108,8 @@ std::istream& operator>>(std::istream& in, pinnable_mapped_file::map_mode& runti
       runtime = pinnable_mapped_file::map_mode::heap;
    else if (s == "locked")
       runtime = pinnable_mapped_file::map_mode::locked;
+   else if (s == "lazy_heap")
+      runtime = pinnable_mapped_file::map_mode::lazy_heap;
    else
       in.setstate(std::ios_base::failbit);
    return in;
@@ -347,6 +1122,8 @@ std::ostream& operator<<(std::ostream& osm, pinnable_mapped_file::map_mode m) {
       osm << "heap";
    else if (m == pinnable_mapped_file::map_mode::locked)
       osm << "locked";
+   else if (m == pinnable_mapped_file::map_mode::lazy_heap)
+      osm << "lazy_heap";
 
    return osm;
 }
@@ -2,8 +2,34 @@
 #include <boost/test/data/test_case.hpp>
 #include <boost/test/data/monomorphic.hpp>
 #include <chainbase/chainbase.hpp>
+#include <chainbase/shared_cow_string.hpp>
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/member.hpp>
 
 using namespace chainbase;
+using namespace boost::multi_index;
+
+struct note : public chainbase::object<1, note> {
+   template<typename Constructor, typename Allocator>
+   note( Constructor&& c, Allocator&& a ) : text(a) {
+      c(*this);
+   }
+
+   id_type id;
+   shared_cow_string text;
+};
+
+typedef multi_index_container<
+  note,
+  indexed_by<
+     ordered_unique< member<note,note::id_type,&note::id> >
+  >,
+  chainbase::node_allocator<note>
+> note_index;
+
+CHAINBASE_SET_INDEX_TYPE( note, note_index )
 
 const pinnable_mapped_file::map_mode test_modes[] = {pinnable_mapped_file::map_mode::mapped, pinnable_mapped_file::map_mode::heap};
 
@@ -32,3 +58,75 @@ BOOST_DATA_TEST_CASE(grow_shrink, boost::unit_test::data::make(test_modes), map_
    }
    bfs::remove_all(temp);
 }
+
+BOOST_DATA_TEST_CASE(compact, boost::unit_test::data::make(test_modes), map_mode) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      const size_t db_size = 64u*1024u*1024u;
+      const int num_notes = 100000;
+      const std::string text(100, 'x');
+
+      chainbase::database db(temp / "src", database::read_write, db_size, false, map_mode);
+      db.add_index<note_index>();
+      for(int i = 0; i < num_notes; ++i)
+         db.create<note>([&](note& n) { n.text.assign(text.data(), text.size()); });
+      // leave only every 16th object behind, scattered across the segment
+      for(int i = 0; i < num_notes; ++i)
+         if(i % 16)
+            db.remove(db.get<note>(note::id_type(i)));
+      db.set_revision(7);
+
+      {
+         chainbase::database dest(temp / "dest", database::read_write, db_size, false, map_mode);
+         dest.add_index<note_index>();
+         db.copy_into(dest);
+         BOOST_CHECK_LT(dest.shrink_to_fit(), db_size / 4);
+         BOOST_CHECK_EQUAL(dest.revision(), 7);
+         BOOST_CHECK_THROW(db.copy_into(dest), std::logic_error);
+      }
+      BOOST_CHECK_LT(bfs::file_size(temp / "dest" / "shared_memory.bin"), db_size / 4);
+
+      chainbase::database dest(temp / "dest", database::read_write, 0, false, map_mode);
+      dest.add_index<note_index>();
+      BOOST_CHECK_EQUAL(dest.get_index<note_index>().indices().size(), num_notes / 16);
+      for(int i = 0; i < num_notes; i += 16)
+         BOOST_CHECK(dest.get<note>(note::id_type(i)).text == db.get<note>(note::id_type(i)).text);
+      const auto& created = dest.create<note>([](note&) {});
+      BOOST_CHECK_EQUAL(created.id._id, num_notes);
+   } catch(...) {
+      bfs::remove_all(temp);
+      throw;
+   }
+   bfs::remove_all(temp);
+}
+
+BOOST_DATA_TEST_CASE(compact_into_growing, boost::unit_test::data::make(test_modes), map_mode) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      const size_t db_size = 64u*1024u*1024u;
+      const size_t dest_size = 2u*1024u*1024u;
+      const int num_notes = 100000;
+      const std::string text(100, 'x');
+
+      chainbase::database db(temp / "src", database::read_write, db_size, false, map_mode);
+      db.add_index<note_index>();
+      for(int i = 0; i < num_notes; ++i)
+         db.create<note>([&](note& n) { n.text.assign(text.data(), text.size()); });
+      for(int i = 1; i < num_notes; i += 2)
+         db.remove(db.get<note>(note::id_type(i)));
+
+      // the objects left take several times the size the destination starts at
+      pinnable_mapped_file::auto_grow_policy policy = {1024*1024, db_size};
+      chainbase::database dest(temp / "dest", database::read_write, dest_size, false, map_mode, {}, 0, false, policy);
+      dest.add_index<note_index>();
+      db.copy_into(dest);
+      BOOST_CHECK_GT(dest.get_segment_stats().size, 4 * dest_size);
+      BOOST_CHECK_EQUAL(dest.get_index<note_index>().indices().size(), num_notes / 2);
+      for(int i = 0; i < num_notes; i += 1000)
+         BOOST_CHECK(dest.get<note>(note::id_type(i)).text == db.get<note>(note::id_type(i)).text);
+   } catch(...) {
+      bfs::remove_all(temp);
+      throw;
+   }
+   bfs::remove_all(temp);
+}
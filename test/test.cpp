@@ -1,13 +1,20 @@
 #define BOOST_TEST_MODULE chainbase test
 
 #include <boost/test/unit_test.hpp>
+#include <boost/test/data/test_case.hpp>
+#include <boost/test/data/monomorphic.hpp>
 #include <chainbase/chainbase.hpp>
+#include <chainbase/static_database.hpp>
 
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/member.hpp>
 
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <random>
+#include <thread>
 
 using namespace chainbase;
 using namespace boost::multi_index;
@@ -38,6 +45,65 @@ typedef multi_index_container<
 
 CHAINBASE_SET_INDEX_TYPE( book, book_index )
 
+struct compact_book : public chainbase::object<1, compact_book> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( compact_book )
+
+   id_type id;
+   int a = 0;
+   int b = 1;
+};
+
+typedef multi_index_container<
+  compact_book,
+  indexed_by<
+     ordered_unique< member<compact_book,compact_book::id_type,&compact_book::id> >,
+     ordered_unique< BOOST_MULTI_INDEX_MEMBER(compact_book,int,a) >,
+     ordered_unique< BOOST_MULTI_INDEX_MEMBER(compact_book,int,b) >
+  >,
+  chainbase::node_allocator<compact_book>
+> compact_book_index;
+
+CHAINBASE_SET_INDEX_TYPE( compact_book, compact_book_index )
+CHAINBASE_SET_COMPACT_HOOKS( compact_book )
+
+struct btree_book : public chainbase::object<2, btree_book> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( btree_book )
+
+   id_type id;
+   int a = 0;
+   int b = 1;
+};
+
+typedef multi_index_container<
+  btree_book,
+  indexed_by<
+     ordered_unique< member<btree_book,btree_book::id_type,&btree_book::id> >,
+     chainbase::btree_unique< BOOST_MULTI_INDEX_MEMBER(btree_book,int,a) >,
+     ordered_unique< BOOST_MULTI_INDEX_MEMBER(btree_book,int,b) >
+  >,
+  chainbase::node_allocator<btree_book>
+> btree_book_index;
+
+CHAINBASE_SET_INDEX_TYPE( btree_book, btree_book_index )
+
+struct directory_book : public chainbase::object<3, directory_book> {
+   CHAINBASE_DEFAULT_CONSTRUCTOR( directory_book )
+
+   id_type id;
+   int a = 0;
+};
+
+typedef multi_index_container<
+  directory_book,
+  indexed_by<
+     ordered_unique< member<directory_book,directory_book::id_type,&directory_book::id> >
+  >,
+  chainbase::node_allocator<directory_book>
+> directory_book_index;
+
+CHAINBASE_SET_INDEX_TYPE( directory_book, directory_book_index )
+CHAINBASE_SET_ID_DIRECTORY( directory_book )
+
 
 BOOST_AUTO_TEST_CASE( open_and_create ) {
    boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
@@ -132,4 +198,890 @@ BOOST_AUTO_TEST_CASE( open_and_create ) {
    bfs::remove_all( temp );
 }
 
+BOOST_DATA_TEST_CASE( heap_mode_reload, boost::unit_test::data::make({0u, 4u}), io_threads ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      const int num_books = 100000;
+      {
+         chainbase::database db(temp, database::read_write, 48*1024*1024, false, pinnable_mapped_file::map_mode::heap, {}, io_threads);
+         db.add_index< book_index >();
+         for( int i = 0; i < num_books; ++i ) {
+            db.create<book>( [&]( book& b ) {
+                b.a = i;
+                b.b = -i;
+            } );
+         }
+      }
+      {
+         chainbase::database db(temp, database::read_write, 48*1024*1024, false, pinnable_mapped_file::map_mode::heap, {}, io_threads);
+         db.add_index< book_index >();
+         BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size(), num_books );
+         for( int i = 0; i < num_books; i += 997 ) {
+            const auto& b = db.get( book::id_type(i) );
+            BOOST_REQUIRE_EQUAL( b.a, i );
+            BOOST_REQUIRE_EQUAL( b.b, -i );
+         }
+         // only the chunks touched here need to be written back
+         for( int i = 0; i < num_books; i += 4999 )
+            db.modify( db.get( book::id_type(i) ), [&]( book& b ) { b.b = i; } );
+      }
+      {
+         chainbase::database db(temp, database::read_only, 48*1024*1024, false, pinnable_mapped_file::map_mode::heap, {}, io_threads);
+         db.add_index< book_index >();
+         BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size(), num_books );
+         for( int i = 0; i < num_books; i += 997 ) {
+            const auto& b = db.get( book::id_type(i) );
+            BOOST_REQUIRE_EQUAL( b.a, i );
+            BOOST_REQUIRE_EQUAL( b.b, i % 4999 ? -i : i );
+         }
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( heap_mode_zeroed_chunks ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      const size_t blob_size = 4*1024*1024;
+      const int num_books = 10000;
+      {
+         chainbase::database db(temp, database::read_write, 16*1024*1024, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< book_index >();
+         for( int i = 0; i < num_books; ++i )
+            db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+         db.get_segment_manager()->construct<char>( "blob" )[blob_size]( char(0x5a) );
+      }
+      {
+         // the blob spans several whole chunks that are all zero by the time they are saved
+         chainbase::database db(temp, database::read_write, 16*1024*1024, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< book_index >();
+         char* blob = db.get_segment_manager()->find<char>( "blob" ).first;
+         BOOST_REQUIRE( blob != nullptr );
+         BOOST_REQUIRE_EQUAL( blob[blob_size-1], 0x5a );
+         memset( blob, 0, blob_size );
+         db.modify( db.get( book::id_type(0) ), [&]( book& b ) { b.b = 1; } );
+      }
+      {
+         chainbase::database db(temp, database::read_only, 0, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< book_index >();
+         const auto [blob, size] = db.get_segment_manager()->find<char>( "blob" );
+         BOOST_REQUIRE_EQUAL( size, blob_size );
+         BOOST_REQUIRE( std::all_of( blob, blob + blob_size, []( char c ) { return c == 0; } ) );
+         BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size(), num_books );
+         for( int i = 0; i < num_books; ++i )
+            BOOST_REQUIRE_EQUAL( db.get( book::id_type(i) ).b, i ? -i : 1 );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_DATA_TEST_CASE( flush_checkpoint, boost::unit_test::data::make({pinnable_mapped_file::map_mode::mapped, pinnable_mapped_file::map_mode::heap}), mode ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 8*1024*1024, false, mode);
+         db.add_index< book_index >();
+         for( int i = 0; i < 1000; ++i )
+            db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+         auto first = db.flush();
+         for( int i = 0; i < 1000; i += 3 )
+            db.modify( db.get( book::id_type(i) ), [&]( book& b ) { b.b = i; } );
+         auto second = db.flush();
+         first.get();
+         second.get();
+         db.create<book>( [&]( book& b ) { b.a = 1000; b.b = -1000; } );
+      }
+      {
+         chainbase::database db(temp, database::read_only, 0, false, mode);
+         db.add_index< book_index >();
+         BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size(), 1001 );
+         for( int i = 0; i < 1000; ++i )
+            BOOST_REQUIRE_EQUAL( db.get( book::id_type(i) ).b, i % 3 ? -i : i );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( lazy_heap_mode ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      const int num_books = 100000;
+      {
+         chainbase::database db(temp, database::read_write, 48*1024*1024, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< book_index >();
+         for( int i = 0; i < num_books; ++i )
+            db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+      }
+      {
+         // closed right away, likely before everything has been loaded
+         chainbase::database db(temp, database::read_write, 48*1024*1024, false, pinnable_mapped_file::map_mode::lazy_heap);
+         db.add_index< book_index >();
+         db.modify( db.get( book::id_type(num_books-1) ), [&]( book& b ) { b.b = num_books; } );
+      }
+      {
+         chainbase::database db(temp, database::read_write, 48*1024*1024, false, pinnable_mapped_file::map_mode::lazy_heap);
+         db.add_index< book_index >();
+         BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size(), num_books );
+         BOOST_REQUIRE_EQUAL( db.get( book::id_type(num_books-1) ).b, num_books );
+         for( int i = 0; i < num_books; i += 997 )
+            db.modify( db.get( book::id_type(i) ), [&]( book& b ) { b.b = i; } );
+      }
+      {
+         chainbase::database db(temp, database::read_only, 0, false, pinnable_mapped_file::map_mode::mapped);
+         db.add_index< book_index >();
+         for( int i = 0; i < num_books-1; ++i )
+            BOOST_REQUIRE_EQUAL( db.get( book::id_type(i) ).b, i % 997 ? -i : i );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( transparent_huge_pages ) {
+   std::ifstream thp_setting( "/sys/kernel/mm/transparent_hugepage/enabled" );
+   std::string setting;
+   if( !std::getline( thp_setting, setting ) || setting.find( "[never]" ) != std::string::npos ) {
+      BOOST_TEST_MESSAGE( "transparent huge pages are unavailable" );
+      return;
+   }
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      // loading the database touches all of it
+      chainbase::database db(temp, database::read_write, 16*1024*1024, false, pinnable_mapped_file::map_mode::heap, {}, 0, true);
+      db.add_index< book_index >();
+      for( int i = 0; i < 10000; ++i )
+         db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+      BOOST_REQUIRE_GT( db.transparent_huge_page_bytes(), 0u );
+      BOOST_REQUIRE_LE( db.transparent_huge_page_bytes(), 16*1024*1024 );
+      BOOST_REQUIRE_EQUAL( db.get( book::id_type(9999) ).b, -9999 );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_DATA_TEST_CASE( auto_grow, boost::unit_test::data::make({pinnable_mapped_file::map_mode::mapped, pinnable_mapped_file::map_mode::heap}), mode ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      const int num_books = 100000;
+      pinnable_mapped_file::auto_grow_policy policy = {2*1024*1024, 64*1024*1024};
+      {
+         chainbase::database db(temp, database::read_write, 4*1024*1024, false, mode, {}, 0, false, policy);
+         db.add_index< book_index >();
+         auto session = db.start_undo_session(true);
+         int constructed = 0;
+         for( int i = 0; i < num_books; ++i )
+            db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; ++constructed; } );
+         session.push();
+         BOOST_REQUIRE_EQUAL( constructed, num_books );
+         const auto created_size = bfs::file_size( temp / "shared_memory.bin" );
+         BOOST_REQUIRE_GT( created_size, 4*1024*1024 );
+         // saving the old values for undo grows the database too
+         auto modify_session = db.start_undo_session(true);
+         for( int i = 0; i < num_books; ++i )
+            db.modify( db.get( book::id_type(i) ), [&]( book& b ) { b.b = -i; } );
+         modify_session.push();
+         db.commit( db.revision() );
+         BOOST_REQUIRE_GT( bfs::file_size( temp / "shared_memory.bin" ), created_size );
+         BOOST_REQUIRE_LE( bfs::file_size( temp / "shared_memory.bin" ), policy.max_size );
+      }
+      {
+         chainbase::database db(temp, database::read_only, 0, false, mode);
+         db.add_index< book_index >();
+         BOOST_REQUIRE_EQUAL( db.get_index<book_index>().indices().size(), num_books );
+         for( int i = 0; i < num_books; i += 997 )
+            BOOST_REQUIRE_EQUAL( db.get( book::id_type(i) ).b, -i );
+      }
+      {
+         // growth stops at max_size
+         policy.max_size = bfs::file_size( temp / "shared_memory.bin" );
+         chainbase::database db(temp, database::read_write, 0, false, mode, {}, 0, false, policy);
+         db.add_index< book_index >();
+         BOOST_CHECK_THROW( for( int i = num_books; i < 10*num_books; ++i ) db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } ), boost::interprocess::bad_alloc );
+         BOOST_REQUIRE_EQUAL( bfs::file_size( temp / "shared_memory.bin" ), policy.max_size );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( memory_stats ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 8*1024*1024);
+      db.add_index< book_index >();
+      for( int i = 0; i < 1000; ++i )
+         db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+
+      auto session = db.start_undo_session(true);
+      for( int i = 0; i < 100; ++i )
+         db.modify( db.get( book::id_type(i) ), [&]( book& b ) { b.b = i + 1000; } );
+      for( int i = 100; i < 150; ++i )
+         db.remove( db.get( book::id_type(i) ) );
+
+      auto stats = db.memory_stats_per_index().at( boost::core::demangle( typeid(book).name() ) );
+      BOOST_CHECK_EQUAL( stats.nodes, 950 );
+      BOOST_CHECK_EQUAL( stats.old_values, 100 );
+      BOOST_CHECK_EQUAL( stats.removed_values, 50 );
+      BOOST_CHECK_GT( stats.node_bytes, 950 * sizeof(book) );
+      BOOST_CHECK_GT( stats.old_values_bytes, 0 );
+      // the nodes come from chunks of 64
+      BOOST_CHECK_GT( stats.freelist_bytes, 0 );
+      session.undo();
+      BOOST_CHECK_EQUAL( db.memory_stats_per_index().begin()->second.old_values, 0 );
+
+      auto segment = db.get_segment_stats();
+      BOOST_CHECK_GT( segment.free_blocks, 0 );
+      BOOST_CHECK_LE( segment.largest_free_block, segment.free_bytes );
+      BOOST_CHECK_LE( segment.free_bytes, segment.size );
+      BOOST_CHECK_LE( segment.free_bytes, db.get_free_memory() );
+      size_t histogram_blocks = 0;
+      for( size_t n : segment.free_block_histogram )
+         histogram_blocks += n;
+      BOOST_CHECK_EQUAL( histogram_blocks, segment.free_blocks );
+      BOOST_CHECK( segment.fragmentation() >= 0.0 && segment.fragmentation() < 1.0 );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( allocator_chunks_pack ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 8*1024*1024);
+      auto* manager = db.get_segment_manager();
+      std::vector<char*> chunks;
+      for( int i = 0; i < 4; ++i )
+         chunks.push_back( (char*)manager->allocate_aligned( allocator_chunk_size, allocator_chunk_alignment ) );
+      // each chunk and the block header in front of the next one take up exactly a page
+      for( std::size_t i = 1; i < chunks.size(); ++i )
+         BOOST_CHECK_EQUAL( chunks[i] - chunks[i-1], allocator_chunk_alignment );
+      for( char* chunk : chunks )
+         manager->deallocate( chunk );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( node_allocator_returns_chunks ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 64*1024*1024);
+      db.add_index< book_index >();
+      const size_t free_before = db.get_free_memory();
+      for( int i = 0; i < 200000; ++i )
+         db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+      BOOST_CHECK_LT( db.get_free_memory(), free_before - 200000 * sizeof(book) );
+
+      // every other object stays behind, so no chunk empties
+      for( int i = 0; i < 200000; i += 2 )
+         db.remove( db.get( book::id_type(i) ) );
+      const size_t free_half = db.get_free_memory();
+      BOOST_CHECK_GT( db.memory_stats_per_index().begin()->second.freelist_bytes, 100000 * sizeof(book) );
+
+      // freed nodes are reused before anything new is taken from the segment
+      for( int i = 0; i < 100000; ++i )
+         db.create<book>( [&]( book& b ) { b.a = 200000 + i; b.b = -200000 - i; } );
+      BOOST_CHECK_EQUAL( db.get_free_memory(), free_half );
+
+      std::vector<book::id_type> ids;
+      for( const book& b : db.get_index<book_index>().indices() )
+         ids.push_back( b.id );
+      for( auto id : ids )
+         db.remove( db.get( id ) );
+      // all but one chunk goes back to the segment
+      BOOST_CHECK_LT( db.memory_stats_per_index().begin()->second.freelist_bytes, 4096 );
+      BOOST_CHECK_GT( db.get_free_memory(), free_before - 64*1024 );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( undo_records_return_chunks ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 64*1024*1024);
+      db.add_index< book_index >();
+      for( int i = 0; i < 10000; ++i )
+         db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+      const size_t free_before = db.get_free_memory();
+
+      size_t used_at_10 = 0;
+      for( int block = 1; block <= 20; ++block ) {
+         db.start_undo_session(true).push();
+         // every block modifies a different half of the objects, so records of several blocks overlap in time
+         for( int i = block % 2; i < 10000; i += 2 )
+            db.modify( db.get( book::id_type(i) ), [&]( book& b ) { b.a += 10000; } );
+         if( block > 2 )
+            db.commit( block - 2 );
+         db.drain_undo();
+         if( block == 10 )
+            used_at_10 = free_before - db.get_free_memory();
+      }
+      // The records of committed blocks go back to the segment a chunk at a time, so use doesn't creep up
+      BOOST_CHECK_LT( free_before - db.get_free_memory(), used_at_10 + 4*4096 );
+
+      db.commit( 20 );
+      db.drain_undo();
+      BOOST_CHECK_EQUAL( db.memory_stats_per_index().begin()->second.old_values, 0u );
+      BOOST_CHECK_GT( db.get_free_memory(), free_before - 3*4096 );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( index_arena ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 16*1024*1024);
+      db.add_index< book_index >();
+      db.reserve_index_arena< book_index >( 1024*1024 );
+      BOOST_CHECK_THROW( db.reserve_index_arena< book_index >( 1024*1024 ), std::logic_error );
+      auto [arena, arena_size] = db.get_index_arena< book_index >();
+      BOOST_REQUIRE_EQUAL( arena_size, 1024*1024 );
+
+      auto in_arena = [&, arena = arena, arena_size = arena_size]( const book& b ) {
+         return (const char*)&b >= arena && (const char*)&b < arena + arena_size;
+      };
+      for( int i = 0; i < 1000; ++i )
+         db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+      for( const book& b : db.get_index<book_index>().indices() )
+         BOOST_CHECK( in_arena( b ) );
+      BOOST_CHECK_GT( db.resident_bytes( arena, arena_size ), 0 );
+      BOOST_CHECK_LE( db.resident_bytes( arena, arena_size ), arena_size );
+
+      // once the arena is full nodes come from the rest of the segment
+      for( int i = 1000; i < 20000; ++i )
+         db.create<book>( [&]( book& b ) { b.a = i; b.b = -i; } );
+      BOOST_CHECK( !in_arena( db.get( book::id_type(19999) ) ) );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( compact_hooks ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      using index_type = generic_index<compact_book_index>;
+      BOOST_CHECK_EQUAL( sizeof(index_type::node) + 3*16, sizeof(generic_index<book_index>::node) );
+      {
+         chainbase::database db(temp, database::read_write, 8*1024*1024);
+         db.add_index< compact_book_index >();
+         for( int i = 0; i < 1000; ++i )
+            db.create<compact_book>( [&]( compact_book& b ) { b.a = i; b.b = -i; } );
+         {
+            auto session = db.start_undo_session(true);
+            for( int i = 0; i < 100; ++i )
+               db.modify( db.get<compact_book>( compact_book::id_type(i) ), [&]( compact_book& b ) { b.a = i + 1000; } );
+            for( int i = 100; i < 200; ++i )
+               db.remove( db.get<compact_book>( compact_book::id_type(i) ) );
+            for( int i = 0; i < 100; ++i )
+               db.create<compact_book>( [&]( compact_book& b ) { b.a = -i - 1; b.b = i + 1; } );
+            BOOST_CHECK_EQUAL( db.get_index<compact_book_index>().indices().size(), 1000 );
+            BOOST_CHECK_EQUAL( db.get_index<compact_book_index>().indices().begin()->a, 1000 );
+         }
+         BOOST_CHECK_EQUAL( db.get_index<compact_book_index>().indices().size(), 1000 );
+         int i = 0;
+         for( const compact_book& b : db.get_index<compact_book_index>().indices().get<1>() )
+            BOOST_CHECK_EQUAL( b.a, i++ );
+      }
+      {
+         // the offsets don't depend on where the database is mapped
+         chainbase::database db(temp, database::read_only, 0, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< compact_book_index >();
+         int i = 0;
+         for( const compact_book& b : db.get_index<compact_book_index>().indices().get<2>() )
+            BOOST_CHECK_EQUAL( b.b, -999 + i++ );
+         BOOST_CHECK_EQUAL( i, 1000 );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+
+   for( uint64_t max_size : { 16ull*1024*1024*1024, 32ull*1024*1024*1024 } ) {
+      temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+      try {
+         // up to 16 GiB is within what the offsets can span
+         pinnable_mapped_file::auto_grow_policy policy = {2*1024*1024, max_size};
+         chainbase::database db(temp, database::read_write, 8*1024*1024, false, pinnable_mapped_file::map_mode::mapped, {}, 0, false, policy);
+         if( max_size > generic_index<compact_book_index>::max_segment_size )
+            BOOST_CHECK_THROW( db.add_index< compact_book_index >(), std::logic_error );
+         else
+            db.add_index< compact_book_index >();
+      } catch ( ... ) {
+         bfs::remove_all( temp );
+         throw;
+      }
+      bfs::remove_all( temp );
+   }
+   BOOST_CHECK_EQUAL( generic_index<compact_book_index>::max_segment_size, 16ull*1024*1024*1024 );
+}
+
+BOOST_AUTO_TEST_CASE( btree_index ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 16*1024*1024);
+         db.add_index< btree_book_index >();
+         for( int i = 0; i < 10000; ++i )
+            db.create<btree_book>( [&]( btree_book& b ) { b.a = i * 2; b.b = -i; } );
+         {
+            auto session = db.start_undo_session(true);
+            for( int i = 0; i < 10000; i += 2 )
+               db.remove( db.get<btree_book>( btree_book::id_type(i) ) );
+            for( int i = 1; i < 10000; i += 2 )
+               db.modify( db.get<btree_book>( btree_book::id_type(i) ), [&]( btree_book& b ) { b.a = -b.a; } );
+            BOOST_CHECK_EQUAL( db.get_index<btree_book_index>().indices().get<1>().begin()->a, -19998 );
+            // less than the tree hooks of an ordered index would take, even with room reserved for undo
+            auto index_bytes = db.memory_stats_per_index().at( boost::core::demangle( typeid(btree_book).name() ) ).index_bytes;
+            BOOST_CHECK_GT( index_bytes, 0 );
+            BOOST_CHECK_LT( index_bytes, 10000 * 4 * sizeof(std::ptrdiff_t) );
+         }
+         BOOST_CHECK_EQUAL( db.get_index<btree_book_index>().indices().get<1>().size(), 10000 );
+         BOOST_CHECK_EQUAL( db.get_index<btree_book_index>().indices().get<1>().find( 4242 )->b, -2121 );
+      }
+      {
+         chainbase::database db(temp, database::read_only, 0, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< btree_book_index >();
+         const auto& idx = db.get_index<btree_book_index>().indices().get<1>();
+         int i = 0;
+         for( const btree_book& b : idx )
+            BOOST_CHECK_EQUAL( b.a, 2 * i++ );
+         BOOST_CHECK_EQUAL( i, 10000 );
+         BOOST_CHECK_EQUAL( idx.lower_bound( 4243 )->a, 4244 );
+         BOOST_CHECK_EQUAL( idx.rbegin()->a, 19998 );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( id_directory ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 16*1024*1024);
+         db.add_index< directory_book_index >();
+         for( int i = 0; i < 10000; ++i )
+            db.create<directory_book>( [&]( directory_book& b ) { b.a = i; } );
+         for( int i = 0; i < 10000; i += 3 )
+            db.remove( db.get<directory_book>( directory_book::id_type(i) ) );
+         {
+            auto session = db.start_undo_session(true);
+            db.remove( db.get<directory_book>( directory_book::id_type(1) ) );
+            db.create<directory_book>( [&]( directory_book& b ) { b.a = -1; } );
+            BOOST_CHECK( db.find<directory_book>( directory_book::id_type(1) ) == nullptr );
+            BOOST_CHECK_EQUAL( db.get<directory_book>( directory_book::id_type(10000) ).a, -1 );
+         }
+         BOOST_CHECK( db.find<directory_book>( directory_book::id_type(10000) ) == nullptr );
+         BOOST_CHECK( db.find<directory_book>( directory_book::id_type(-1) ) == nullptr );
+      }
+      {
+         chainbase::database db(temp, database::read_only, 0, false, pinnable_mapped_file::map_mode::heap);
+         db.add_index< directory_book_index >();
+         for( int i = 0; i < 10000; ++i ) {
+            const directory_book* b = db.find<directory_book>( directory_book::id_type(i) );
+            if( i % 3 == 0 ) {
+               BOOST_CHECK( b == nullptr );
+            } else {
+               BOOST_REQUIRE( b != nullptr );
+               BOOST_CHECK_EQUAL( b->a, i );
+            }
+         }
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+// Constructors read once in order, like rows of a snapshot read from a stream
+struct book_stream {
+   int next;
+   int last;
+   int constructed = 0;
+   struct iterator {
+      using iterator_category = std::input_iterator_tag;
+      using value_type = std::function<void(book&)>;
+      using difference_type = std::ptrdiff_t;
+      using pointer = void;
+      using reference = value_type;
+      book_stream* stream;
+      bool at_end() const { return !stream || stream->next == stream->last; }
+      value_type operator*() const {
+         return [s = stream, i = stream->next]( book& b ) { b.a = -i; b.b = i; ++s->constructed; };
+      }
+      iterator& operator++() { ++stream->next; return *this; }
+      bool operator==( const iterator& other ) const { return at_end() == other.at_end(); }
+      bool operator!=( const iterator& other ) const { return !( *this == other ); }
+   };
+   iterator begin() { return { this }; }
+   iterator end() { return { nullptr }; }
+};
+
+BOOST_AUTO_TEST_CASE( bulk_load ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      pinnable_mapped_file::auto_grow_policy policy = {1024*1024, 64*1024*1024};
+      chainbase::database db(temp, database::read_write, 4*1024*1024, false, pinnable_mapped_file::map_mode::mapped, {}, 0, false, policy);
+      db.add_index< book_index >();
+      std::vector<std::function<void(book&)>> rows;
+      for( int i = 0; i < 20000; ++i )
+         rows.push_back( [i]( book& b ) { b.a = 20000 - i; b.b = i; } );
+      db.bulk_load<book>( rows );
+      const auto& idx = db.get_index<book_index>();
+      BOOST_REQUIRE_EQUAL( idx.size(), 20000u );
+      BOOST_CHECK_EQUAL( db.get<book>( book::id_type(5) ).a, 19995 );
+      BOOST_CHECK_EQUAL( db.get_index<book_index>().indices().get<1>().begin()->b, 19999 );
+      int expected = 1;
+      for( const book& b : db.get_index<book_index>().indices().get<1>() )
+         BOOST_REQUIRE_EQUAL( b.a, expected++ );
+
+      auto session = db.start_undo_session(true);
+      BOOST_CHECK_THROW( db.bulk_load<book>( rows ), std::logic_error );
+      BOOST_CHECK_EQUAL( idx.size(), 20000u );
+      session.undo();
+
+      // a single pass range, with more objects than the database has room for until it grows
+      book_stream stream{ 20000, 80000 };
+      db.bulk_load<book>( stream );
+      BOOST_CHECK_EQUAL( stream.constructed, 60000 );
+      BOOST_CHECK_EQUAL( db.get<book>( book::id_type(79999) ).b, 79999 );
+      BOOST_CHECK_GT( db.get_segment_manager()->get_size(), 8*1024*1024 );
+
+      session = db.start_undo_session(true);
+      BOOST_CHECK_THROW( db.bulk_load<book>( rows ), std::logic_error );
+      BOOST_CHECK_EQUAL( idx.size(), 80000u );
+
+      db.modify_fields( db.get<book>( book::id_type(7) ), []( book& b ) { b.b = -7; }, &book::b );
+      BOOST_CHECK_EQUAL( db.get_index<book_index>().memory_stats().field_values, 1u );
+      BOOST_CHECK_EQUAL( db.get_index<book_index>().memory_stats().old_values, 0u );
+      session.undo();
+      BOOST_CHECK_EQUAL( db.get<book>( book::id_type(7) ).b, 7 );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( lazy_undo_sessions ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      {
+         chainbase::database db(temp, database::read_write, 8*1024*1024);
+         db.add_index< book_index >();
+         db.add_index< directory_book_index >();
+         const auto& books = db.get_index<book_index>();
+         const auto& directory_books = db.get_index<directory_book_index>();
+         db.create<book>( []( book& b ) { b.a = 1; b.b = 1; } );
+
+         auto session1 = db.start_undo_session(true);
+         db.modify( db.get<book>( book::id_type(0) ), []( book& b ) { b.a = 2; } );
+         auto session2 = db.start_undo_session(true);
+         db.create<directory_book>( []( directory_book& d ) { d.a = 3; } );
+         BOOST_CHECK( books.undo_stack_revision_range() == std::make_pair( int64_t(0), int64_t(2) ) );
+         BOOST_CHECK( directory_books.undo_stack_revision_range() == std::make_pair( int64_t(0), int64_t(2) ) );
+
+         // A session that writes nothing leaves the indices alone
+         db.start_undo_session(true).undo();
+         BOOST_CHECK_EQUAL( db.revision(), 2 );
+
+         session2.squash();
+         BOOST_CHECK_EQUAL( db.revision(), 1 );
+         BOOST_CHECK_EQUAL( directory_books.size(), 1u );
+         session1.undo();
+         BOOST_CHECK_EQUAL( db.revision(), 0 );
+         BOOST_CHECK_EQUAL( directory_books.size(), 0u );
+         BOOST_CHECK_EQUAL( db.get<book>( book::id_type(0) ).a, 1 );
+
+         db.start_undo_session(true).push();
+         db.start_undo_session(true).push();
+         db.create<directory_book>( []( directory_book& d ) { d.a = 4; } );
+         db.start_undo_session(true).push();
+         db.modify( db.get<book>( book::id_type(0) ), []( book& b ) { b.a = 5; } );
+         db.commit(2);
+         BOOST_CHECK( books.undo_stack_revision_range() == std::make_pair( int64_t(2), int64_t(3) ) );
+         BOOST_CHECK_EQUAL( directory_books.memory_stats().removed_values, 0u );
+
+         // Assigning to a session undoes the one it held
+         auto session3 = db.start_undo_session(true);
+         db.create<directory_book>( []( directory_book& d ) { d.a = 7; } );
+         session3 = db.start_undo_session(false);
+         BOOST_CHECK_EQUAL( db.revision(), 3 );
+         BOOST_CHECK_EQUAL( directory_books.size(), 1u );
+
+         auto session4 = db.start_undo_session(true);
+         db.modify( db.get<book>( book::id_type(0) ), []( book& b ) { b.a = 9; } );
+         db.create<directory_book>( []( directory_book& d ) { d.a = 9; } );
+         session4.push();
+      }
+      {
+         // The last session wrote to books, which are not added here, so it can't be undone, squashed or committed.
+         // Nothing changes, not even the directory_books that would be undone first.
+         chainbase::database db(temp, database::read_write);
+         db.add_index< directory_book_index >();
+         BOOST_CHECK_THROW( db.undo(), std::logic_error );
+         BOOST_CHECK_THROW( db.squash(), std::logic_error );
+         BOOST_CHECK_THROW( db.commit( 4 ), std::logic_error );
+         BOOST_CHECK_EQUAL( db.revision(), 4 );
+         BOOST_CHECK_EQUAL( db.get_index<directory_book_index>().size(), 2u );
+         BOOST_CHECK( db.get_index<directory_book_index>().undo_stack_revision_range() == std::make_pair( int64_t(2), int64_t(4) ) );
+         {
+            auto session = db.start_undo_session(true);
+            db.create<directory_book>( []( directory_book& d ) { d.a = 8; } );
+         }
+         BOOST_CHECK_EQUAL( db.get_index<directory_book_index>().size(), 2u );
+      }
+      {
+         chainbase::database db(temp, database::read_write);
+         db.add_index< book_index >();
+         db.add_index< directory_book_index >();
+         BOOST_CHECK_EQUAL( db.revision(), 4 );
+         BOOST_CHECK( db.get_index<directory_book_index>().undo_stack_revision_range() == std::make_pair( int64_t(2), int64_t(4) ) );
+
+         // An index added while there are sessions has no changes in them
+         db.add_index< btree_book_index >();
+         BOOST_CHECK( db.get_index<btree_book_index>().undo_stack_revision_range() == std::make_pair( int64_t(2), int64_t(4) ) );
+         db.create<btree_book>( []( btree_book& b ) { b.a = 6; } );
+
+         db.undo_all();
+         BOOST_CHECK_EQUAL( db.revision(), 2 );
+         BOOST_CHECK_EQUAL( db.get<book>( book::id_type(0) ).a, 1 );
+         BOOST_CHECK_EQUAL( db.get_index<directory_book_index>().size(), 1u );
+         BOOST_CHECK_EQUAL( db.get_index<btree_book_index>().size(), 0u );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( static_schema ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      {
+         chainbase::static_database<book_index, directory_book_index> db(temp, database::read_write, 8*1024*1024);
+         // nothing to undo or squash
+         db.undo();
+         db.squash();
+         db.undo_all();
+         BOOST_CHECK_EQUAL( db.revision(), 0 );
+         const auto& b0 = db.create<book>( []( book& b ) { b.a = 1; b.b = 2; } );
+         BOOST_CHECK_EQUAL( db.get<book>( book::id_type(0) ).a, 1 );
+         BOOST_CHECK_EQUAL( db.get_index<book_index>().indices().get<2>().find( 2 )->a, 1 );
+         {
+            auto session = db.start_undo_session(true);
+            db.modify( b0, []( book& b ) { b.a = 3; } );
+            db.create<directory_book>( []( directory_book& d ) { d.a = 4; } );
+            BOOST_CHECK_EQUAL( db.revision(), 1 );
+         }
+         BOOST_CHECK_EQUAL( b0.a, 1 );
+         BOOST_CHECK( db.find<directory_book>( directory_book::id_type(0) ) == nullptr );
+
+         auto session1 = db.start_undo_session(true);
+         db.create<directory_book>( []( directory_book& d ) { d.a = 5; } );
+         auto session2 = db.start_undo_session(true);
+         db.modify_nonkey( b0, []( book& b ) { b.a = 6; } );
+         session2.squash();
+         session1.push();
+         db.start_undo_session(true).push();
+         db.remove( b0 );
+         db.commit(1);
+         BOOST_CHECK( db.get_index<book_index>().undo_stack_revision_range() == std::make_pair( int64_t(1), int64_t(2) ) );
+      }
+      {
+         // The same segment opened by a database
+         chainbase::database db(temp, database::read_write);
+         db.add_index< book_index >();
+         db.add_index< directory_book_index >();
+         BOOST_CHECK_EQUAL( db.revision(), 2 );
+         db.undo();
+         BOOST_CHECK_EQUAL( db.get<book>( book::id_type(0) ).a, 6 );
+         BOOST_CHECK_EQUAL( db.get<directory_book>( directory_book::id_type(0) ).a, 5 );
+      }
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
+BOOST_AUTO_TEST_CASE( parallel_undo ) {
+   boost::filesystem::path temp1 = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   boost::filesystem::path temp2 = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database serial(temp1, database::read_write, 16*1024*1024);
+      chainbase::database parallel(temp2, database::read_write, 16*1024*1024);
+      int executor_calls = 0;
+      parallel.set_undo_executor( [&]( size_t count, const std::function<void( size_t )>& task ) {
+         ++executor_calls;
+         std::vector<std::thread> threads;
+         for( size_t i = 0; i < count; ++i )
+            threads.emplace_back( task, i );
+         for( std::thread& t : threads )
+            t.join();
+      }, 8 );
+      std::vector<chainbase::database::session> serial_sessions, parallel_sessions;
+      for( chainbase::database* db : { &serial, &parallel } ) {
+         db->add_index< book_index >();
+         db->add_index< directory_book_index >();
+         db->add_index< btree_book_index >();
+      }
+
+      std::mt19937 rng;
+      auto check_equal = [&] {
+         BOOST_REQUIRE_EQUAL( serial.revision(), parallel.revision() );
+         BOOST_REQUIRE( serial.get_index<book_index>().undo_stack_revision_range() == parallel.get_index<book_index>().undo_stack_revision_range() );
+         BOOST_REQUIRE_EQUAL( serial.get_index<book_index>().size(), parallel.get_index<book_index>().size() );
+         for( const book& b : serial.get_index<book_index>().indices() )
+            BOOST_REQUIRE_EQUAL( parallel.get<book>( b.id ).a, b.a );
+         BOOST_REQUIRE_EQUAL( serial.get_index<directory_book_index>().size(), parallel.get_index<directory_book_index>().size() );
+         for( const directory_book& d : serial.get_index<directory_book_index>().indices() )
+            BOOST_REQUIRE_EQUAL( parallel.get<directory_book>( d.id ).a, d.a );
+         BOOST_REQUIRE_EQUAL( serial.get_index<btree_book_index>().size(), parallel.get_index<btree_book_index>().size() );
+         for( const btree_book& b : serial.get_index<btree_book_index>().indices() )
+            BOOST_REQUIRE_EQUAL( parallel.get<btree_book>( b.id ).a, b.a );
+      };
+      int next_value = 0;
+      for( int round = 0; round < 2000; ++round ) {
+         unsigned op = rng() % 16;
+         int value = ++next_value;
+         unsigned which = rng() % 3;
+         unsigned pick = rng();
+         for( chainbase::database* db : { &serial, &parallel } ) {
+            auto& sessions = db == &serial ? serial_sessions : parallel_sessions;
+            if( op == 0 ) {
+               sessions.push_back( db->start_undo_session(true) );
+            } else if( op == 1 && !sessions.empty() ) {
+               sessions.back().undo();
+               sessions.pop_back();
+            } else if( op == 2 && !sessions.empty() ) {
+               sessions.back().squash();
+               sessions.pop_back();
+            } else if( op == 3 && sessions.size() > 4 ) {
+               db->commit( db->revision() - 3 );
+               for( auto& s : sessions ) s.push();
+               sessions.erase( sessions.begin(), sessions.end() - 3 );
+            } else if( which == 0 ) {
+               const auto& idx = db->get_index<book_index>().indices();
+               if( op < 10 || idx.empty() ) {
+                  db->create<book>( [&]( book& b ) { b.a = value; b.b = -value; } );
+               } else {
+                  const book& b = *std::next( idx.begin(), pick % idx.size() );
+                  if( op < 13 ) db->modify( b, [&]( book& b ) { b.a = value; } );
+                  else db->remove( b );
+               }
+            } else if( which == 1 ) {
+               const auto& idx = db->get_index<directory_book_index>().indices();
+               if( op < 10 || idx.empty() ) {
+                  db->create<directory_book>( [&]( directory_book& d ) { d.a = value; } );
+               } else {
+                  const directory_book& d = *std::next( idx.begin(), pick % idx.size() );
+                  if( op < 13 ) db->modify( d, [&]( directory_book& d ) { d.a = value; } );
+                  else db->remove( d );
+               }
+            } else {
+               const auto& idx = db->get_index<btree_book_index>().indices();
+               if( op < 10 || idx.empty() ) {
+                  db->create<btree_book>( [&]( btree_book& b ) { b.a = value; b.b = value; } );
+               } else {
+                  const btree_book& b = *std::next( idx.begin(), pick % idx.size() );
+                  if( op < 13 ) db->modify( b, [&]( btree_book& b ) { b.a = value; } );
+                  else db->remove( b );
+               }
+            }
+         }
+         if( round % 100 == 0 )
+            check_equal();
+      }
+      check_equal();
+      for( auto& s : serial_sessions ) s.push();
+      for( auto& s : parallel_sessions ) s.push();
+      serial.undo_all();
+      parallel.undo_all();
+      check_equal();
+      BOOST_CHECK_GT( executor_calls, 0 );
+   } catch ( ... ) {
+      bfs::remove_all( temp1 );
+      bfs::remove_all( temp2 );
+      throw;
+   }
+   bfs::remove_all( temp1 );
+   bfs::remove_all( temp2 );
+}
+
+BOOST_AUTO_TEST_CASE( reclaim_undo ) {
+   boost::filesystem::path temp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+   try {
+      chainbase::database db(temp, database::read_write, 8*1024*1024);
+      db.add_index< book_index >();
+      db.add_index< directory_book_index >();
+      db.set_undo_reclaim_slice( 0 );
+      for( int i = 0; i < 100; ++i )
+         db.create<book>( [&]( book& b ) { b.a = i; b.b = i; } );
+      for( int block = 0; block < 10; ++block ) {
+         db.start_undo_session(true).push();
+         for( int i = 0; i < 100; ++i )
+            db.modify( db.get<book>( book::id_type(i) ), [&]( book& b ) { b.a += 1000; } );
+         db.create<directory_book>( []( directory_book& ) {} );
+      }
+      const auto& books = db.get_index<book_index>();
+      BOOST_CHECK_EQUAL( books.memory_stats().old_values, 1000u );
+
+      db.commit( 9 );
+      BOOST_CHECK_EQUAL( books.memory_stats().old_values, 1000u );
+      BOOST_CHECK_EQUAL( db.reclaim_undo( 250 ), 250u );
+      BOOST_CHECK_EQUAL( books.memory_stats().old_values, 750u );
+      db.drain_undo();
+      // The newest committed record marks the end of the last session
+      BOOST_CHECK_EQUAL( books.memory_stats().old_values, 101u );
+      BOOST_CHECK_EQUAL( db.reclaim_undo( 10 ), 0u );
+
+      db.undo();
+      BOOST_CHECK_EQUAL( db.get<book>( book::id_type(5) ).a, 9005 );
+      BOOST_CHECK_EQUAL( db.get_index<directory_book_index>().size(), 9u );
+
+      db.set_undo_reclaim_slice( 4096 );
+      db.start_undo_session(true).push();
+      db.modify( db.get<book>( book::id_type(5) ), []( book& b ) { b.a = 0; } );
+      db.commit( 10 );
+      BOOST_CHECK_EQUAL( books.memory_stats().old_values, 0u );
+   } catch ( ... ) {
+      bfs::remove_all( temp );
+      throw;
+   }
+   bfs::remove_all( temp );
+}
+
 // BOOST_AUTO_TEST_SUITE_END()
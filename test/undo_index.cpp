@@ -2,11 +2,16 @@
 
 #include <boost/multi_index/member.hpp>
 #include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/hashed_index.hpp>
 
 #include <boost/test/unit_test.hpp>
 #include <boost/test/data/monomorphic.hpp>
 #include <boost/test/data/test_case.hpp>
 
+#include <cstring>
+#include <functional>
+#include <random>
+
 
 namespace {
 int exception_counter = 0;
@@ -53,7 +58,10 @@ struct test_allocator : std::allocator<T> {
    struct rebind { using other = test_allocator<U>; };
    T* allocate(std::size_t count) {
       throw_point<std::bad_alloc>();
-      return std::allocator<T>::allocate(count);
+      T* result = std::allocator<T>::allocate(count);
+      // garbage, so that reading memory nothing was constructed in shows up
+      std::memset(static_cast<void*>(result), 0x5a, count * sizeof(T));
+      return result;
    }
 };
 
@@ -83,8 +91,18 @@ struct key_impl<T C::*> { template<auto F> using fn = boost::multi_index::member
 template<auto Fn>
 using key = typename key_impl<decltype(Fn)>::template fn<Fn>;
 
+struct directory_element_t {
+   template<typename C, typename A>
+   directory_element_t(C&& c, const std::allocator<A>&) { c(*this); }
+   uint64_t id;
+   int secondary;
+   throwing_copy dummy;
+};
+
 }
 
+CHAINBASE_SET_ID_DIRECTORY(directory_element_t)
+
 BOOST_AUTO_TEST_SUITE(undo_index_tests)
 
 #define EXCEPTION_TEST_CASE(name)                               \
@@ -117,6 +135,14 @@ struct test_element_t {
    throwing_copy dummy;
 };
 
+struct wide_element_t {
+   template<typename C, typename A>
+   wide_element_t(C&& c, const std::allocator<A>&) { c(*this); }
+   uint64_t id;
+   int secondary;
+   uint64_t values[12] = {};
+};
+
 // If an exception is thrown while an undo session is active, undo will restore the state.
 template<typename C>
 auto capture_state(const C& index) {
@@ -346,6 +372,71 @@ EXCEPTION_TEST_CASE(test_insert_modify_squash) {
    BOOST_TEST(i0.find(1) == nullptr);
 }
 
+EXCEPTION_TEST_CASE(test_sparse_sessions) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+   i0.emplace([](test_element_t& elem) { elem.secondary = 42; });
+   {
+   auto undo_checker = capture_state(i0);
+   auto session1 = i0.start_undo_session(true);
+   i0.modify(*i0.find(0), [](test_element_t& elem) { elem.secondary = 12; });
+   {
+   auto session2 = i0.start_undo_session(true);
+   auto session3 = i0.start_undo_session(true);
+   i0.emplace([](test_element_t& elem) { elem.secondary = 24; });
+   BOOST_TEST(std::distance(i0.last_undo_session().new_values.begin(), i0.last_undo_session().new_values.end()) == 1);
+   session3.squash();
+   BOOST_TEST((i0.undo_stack_revision_range() == std::pair<int64_t, int64_t>(0, 2)));
+   BOOST_TEST(std::distance(i0.last_undo_session().new_values.begin(), i0.last_undo_session().new_values.end()) == 1);
+   session2.squash();
+   }
+   BOOST_TEST(i0.find(1)->secondary == 24);
+   BOOST_TEST(std::distance(i0.last_undo_session().old_values.begin(), i0.last_undo_session().old_values.end()) == 1);
+   BOOST_TEST(std::distance(i0.last_undo_session().new_values.begin(), i0.last_undo_session().new_values.end()) == 1);
+   }
+   BOOST_TEST(i0.find(0)->secondary == 42);
+   BOOST_TEST(i0.find(1) == nullptr);
+
+   i0.start_undo_session(true).push();
+   i0.modify(*i0.find(0), [](test_element_t& elem) { elem.secondary = 12; });
+   i0.start_undo_session(true).push();
+   i0.start_undo_session(true).push();
+   i0.emplace([](test_element_t& elem) { elem.secondary = 24; });
+   i0.commit(2);
+   BOOST_TEST((i0.undo_stack_revision_range() == std::pair<int64_t, int64_t>(2, 3)));
+   i0.undo_all();
+   BOOST_TEST(i0.find(0)->secondary == 12);
+   BOOST_TEST(i0.find(1) == nullptr);
+}
+
+EXCEPTION_TEST_CASE(test_reclaim) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+   for(int i = 0; i < 3; ++i)
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i; });
+   i0.start_undo_session(true).push();
+   for(int i = 0; i < 3; ++i)
+      i0.modify(*i0.find(i), [&](test_element_t& elem) { elem.secondary = 10 + i; });
+   i0.start_undo_session(true).push();
+   i0.modify(*i0.find(0), [](test_element_t& elem) { elem.secondary = 20; });
+   i0.remove(*i0.find(1));
+   // Committing the first session only marks its records
+   i0.commit_undo_states(1);
+   BOOST_TEST(i0.memory_stats().old_values == 4u);
+   BOOST_TEST(i0.reclaim(1) == 1u);
+   // The end of the remaining session stays until it is gone
+   BOOST_TEST(i0.reclaim(10) == 1u);
+   BOOST_TEST(i0.memory_stats().old_values == 2u);
+   i0.undo();
+   BOOST_TEST(i0.find(0)->secondary == 10);
+   BOOST_TEST(i0.find(1)->secondary == 11);
+   BOOST_TEST(i0.find(2)->secondary == 12);
+   BOOST_TEST(i0.reclaim(10) == 1u);
+   BOOST_TEST(i0.memory_stats().old_values == 0u);
+}
+
 EXCEPTION_TEST_CASE(test_insert_remove_undo) {
    chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
                          boost::multi_index::ordered_unique<key<&test_element_t::id>>,
@@ -606,4 +697,468 @@ BOOST_AUTO_TEST_CASE(test_project) {
    BOOST_TEST(i0.project<1>(i0.end()) == i0.get<by_secondary>().end());
 }
 
+EXCEPTION_TEST_CASE(test_btree_undo) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         chainbase::btree_unique<key<&test_element_t::secondary>>> i0;
+   for(int i = 0; i < 200; ++i)
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i * 2; });
+   {
+   auto undo_checker = capture_state(i0);
+   auto session = i0.start_undo_session(true);
+   for(int i = 0; i < 200; i += 3)
+      i0.modify(*i0.find(i), [&](test_element_t& elem) { elem.secondary = 1000 - i * 2 - 1; });
+   for(int i = 1; i < 200; i += 3)
+      i0.remove(*i0.find(i));
+   for(int i = 0; i < 50; ++i)
+      i0.emplace([&](test_element_t& elem) { elem.secondary = -i; });
+   BOOST_TEST(i0.get<1>().size() == 183);
+   BOOST_TEST(i0.get<1>().find(1000 - 1)->id == 0);
+   BOOST_TEST(i0.get<1>().begin()->secondary == -49);
+   }
+   BOOST_TEST(i0.get<1>().size() == 200);
+   int expected = 0;
+   for(const auto& elem : i0.get<1>()) {
+      BOOST_TEST(elem.secondary == expected);
+      expected += 2;
+   }
+}
+
+EXCEPTION_TEST_CASE(test_btree_modify_fail) {
+   chainbase::undo_index<conflict_element_t, test_allocator<conflict_element_t>,
+                         boost::multi_index::ordered_unique<key<&conflict_element_t::id>>,
+                         chainbase::btree_unique<key<&conflict_element_t::x0>>,
+                         chainbase::btree_unique<key<&conflict_element_t::x1>>,
+                         boost::multi_index::ordered_unique<key<&conflict_element_t::x2>>> i0;
+   i0.emplace([](conflict_element_t& elem) { elem.x0 = 10; elem.x1 = 10; elem.x2 = 10; });
+   i0.emplace([](conflict_element_t& elem) { elem.x0 = 11; elem.x1 = 11; elem.x2 = 11; });
+   i0.emplace([](conflict_element_t& elem) { elem.x0 = 12; elem.x1 = 12; elem.x2 = 12; });
+   {
+   auto session = i0.start_undo_session(true);
+   i0.emplace([](conflict_element_t& elem) { elem.x0 = 71; elem.x1 = 81; elem.x2 = 91; });
+   BOOST_CHECK_THROW(i0.modify(i0.get(3), [](conflict_element_t& elem) { elem.x0 = 72; elem.x1 = 10; elem.x2 = 92; }), std::logic_error);
+   BOOST_CHECK_THROW(i0.modify(i0.get(1), [](conflict_element_t& elem) { elem.x0 = 15; elem.x1 = 15; elem.x2 = 10; }), std::logic_error);
+   BOOST_TEST(i0.get<1>().size() == 3);
+   BOOST_TEST(i0.get<1>().find(11)->id == 1);
+   BOOST_TEST((i0.get<1>().find(15) == i0.get<1>().end()));
+   BOOST_TEST((i0.get<2>().find(15) == i0.get<2>().end()));
+   }
+   BOOST_TEST(i0.get<1>().size() == 3);
+   BOOST_TEST(i0.get<2>().size() == 3);
+   BOOST_TEST(i0.get<1>().find(11)->x1 == 11);
+   BOOST_TEST(i0.get<2>().find(12)->x0 == 12);
+   BOOST_TEST((i0.get<2>().find(81) == i0.get<2>().end()));
+}
+
+EXCEPTION_TEST_CASE(test_id_directory) {
+   chainbase::undo_index<directory_element_t, test_allocator<directory_element_t>,
+                         boost::multi_index::ordered_unique<key<&directory_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&directory_element_t::secondary>>> i0;
+   for(int i = 0; i < 100; ++i)
+      i0.emplace([&](directory_element_t& elem) { elem.secondary = i; });
+   i0.remove(*i0.find(7));
+   BOOST_TEST(i0.find(7) == nullptr);
+   BOOST_TEST(i0.find(8)->secondary == 8);
+   BOOST_TEST(i0.find(100) == nullptr);
+   BOOST_TEST(i0.find(uint64_t(-1)) == nullptr);
+   {
+   auto session = i0.start_undo_session(true);
+   i0.remove(*i0.find(10));
+   i0.emplace([](directory_element_t& elem) { elem.secondary = 1000; });
+   BOOST_TEST(i0.find(10) == nullptr);
+   BOOST_TEST(i0.find(100)->secondary == 1000);
+   }
+   BOOST_TEST(i0.find(10)->secondary == 10);
+   // without an undo session, a failed modify removes the object
+   BOOST_CHECK_THROW(i0.modify(*i0.find(11), [](directory_element_t& elem) { elem.secondary = 12; }), std::logic_error);
+   BOOST_TEST(i0.find(11) == nullptr);
+   BOOST_TEST(i0.find(100) == nullptr);
+   for(const auto& elem : i0)
+      BOOST_TEST(i0.find(elem.id) == &elem);
+   i0.emplace([](directory_element_t& elem) { elem.secondary = 2000; });
+   BOOST_TEST(i0.find(100)->secondary == 2000);
+}
+
+EXCEPTION_TEST_CASE(test_non_unique) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_non_unique<key<&test_element_t::secondary>>> i0;
+   auto ids = [&](int secondary) {
+      std::vector<uint64_t> result;
+      auto [begin, end] = i0.get<1>().equal_range(secondary);
+      for(auto iter = begin; iter != end; ++iter) result.push_back(iter->id);
+      return result;
+   };
+   for(int i = 0; i < 12; ++i)
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i % 3; });
+   BOOST_TEST(ids(1) == (std::vector<uint64_t>{1, 4, 7, 10}));
+   BOOST_TEST(i0.get<1>().find(2)->id == 2);
+   auto check_initial = [&] {
+      BOOST_TEST(ids(0) == (std::vector<uint64_t>{0, 3, 6, 9}));
+      BOOST_TEST(ids(1) == (std::vector<uint64_t>{1, 4, 7, 10}));
+      BOOST_TEST(ids(2) == (std::vector<uint64_t>{2, 5, 8, 11}));
+   };
+   {
+   auto undo_checker = scope_fail{[&] { check_initial(); }};
+   auto session = i0.start_undo_session(true);
+   i0.modify(*i0.find(0), [](test_element_t& elem) { elem.secondary = 1; });
+   i0.modify(*i0.find(10), [](test_element_t& elem) { elem.secondary = 2; });
+   i0.remove(*i0.find(4));
+   i0.emplace([](test_element_t& elem) { elem.secondary = 1; });
+   BOOST_TEST(ids(0) == (std::vector<uint64_t>{3, 6, 9}));
+   BOOST_TEST(ids(1) == (std::vector<uint64_t>{0, 1, 7, 12}));
+   BOOST_TEST(ids(2) == (std::vector<uint64_t>{2, 5, 8, 10, 11}));
+   BOOST_TEST(i0.get<1>().lower_bound(1)->id == 0);
+   BOOST_TEST(i0.get<1>().upper_bound(1)->id == 2);
+   }
+   check_initial();
+}
+
+EXCEPTION_TEST_CASE(test_bulk_load) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i0;
+   auto constructors = [](std::vector<int> secondaries) {
+      std::vector<std::function<void(test_element_t&)>> result;
+      for(int secondary : secondaries)
+         result.push_back([secondary](test_element_t& elem) { elem.secondary = secondary; });
+      return result;
+   };
+   i0.emplace([](test_element_t& elem) { elem.secondary = 0; });
+   i0.bulk_load(constructors({30, 10, 20, 40}));
+   BOOST_TEST(i0.size() == 5);
+   BOOST_TEST(i0.get<1>().find(10)->id == 2);
+   BOOST_TEST(i0.get<1>().rbegin()->id == 4);
+   {
+   auto undo_checker = capture_state(i0);
+   BOOST_CHECK_THROW(i0.bulk_load(constructors({50, 60, 50})), std::logic_error);
+   BOOST_CHECK_THROW(i0.bulk_load(constructors({5, 10})), std::logic_error);
+   }
+   i0.bulk_load(constructors({15, 25, 5}));
+   BOOST_TEST(i0.size() == 8);
+   BOOST_TEST(i0.find(7)->secondary == 5);
+   BOOST_TEST(i0.get<1>().begin()->id == 0);
+   BOOST_TEST(std::next(i0.get<1>().begin())->id == 7);
+   auto session = i0.start_undo_session(true);
+   BOOST_CHECK_THROW(i0.bulk_load(constructors({100})), std::logic_error);
+   i0.emplace([](test_element_t& elem) { elem.secondary = 100; });
+   BOOST_TEST(i0.find(8)->secondary == 100);
+}
+
+EXCEPTION_TEST_CASE(test_modify_nonkey) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>> i0;
+   for(int i = 0; i < 3; ++i)
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i; });
+   {
+      auto session = i0.start_undo_session(true);
+      i0.modify_nonkey(*i0.find(1), [](test_element_t& elem) { elem.secondary = 10; });
+      i0.modify_nonkey(*i0.find(1), [](test_element_t& elem) { elem.secondary += 10; });
+      BOOST_TEST(i0.find(1)->secondary == 20);
+   }
+   BOOST_TEST(i0.find(1)->secondary == 1);
+   {
+      auto session = i0.start_undo_session(true);
+      i0.modify_nonkey(*i0.find(2), [](test_element_t& elem) { elem.secondary = 30; });
+      session.push();
+   }
+   BOOST_TEST(i0.find(2)->secondary == 30);
+   i0.undo();
+   BOOST_TEST(i0.find(2)->secondary == 2);
+
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_non_unique<key<&test_element_t::secondary>>,
+                         chainbase::btree_unique<key<&test_element_t::secondary>>,
+                         boost::multi_index::hashed_unique<key<&test_element_t::secondary>>> i1;
+   for(int i = 0; i < 3; ++i)
+      i1.emplace([&](test_element_t& elem) { elem.secondary = i; });
+   auto session = i1.start_undo_session(true);
+   i1.modify_nonkey(*i1.find(1), [](test_element_t& elem) { elem.dummy = throwing_copy{}; });
+   BOOST_TEST(i1.get<3>().find(1)->id == 1);
+}
+
+EXCEPTION_TEST_CASE(test_modify_fields) {
+   chainbase::undo_index<wide_element_t, test_allocator<wide_element_t>,
+                         boost::multi_index::ordered_unique<key<&wide_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&wide_element_t::secondary>>> i0;
+   for(int i = 0; i < 10; ++i)
+      i0.emplace([&](wide_element_t& elem) { elem.secondary = i; elem.values[i] = i; });
+   auto values = [&] {
+      std::vector<std::pair<int, std::vector<uint64_t>>> result;
+      for(const auto& elem : i0.get<1>())
+         result.emplace_back(elem.secondary, std::vector<uint64_t>(std::begin(elem.values), std::end(elem.values)));
+      return result;
+   };
+   auto initial = values();
+   {
+      auto undo_checker = scope_fail{[&]{ BOOST_TEST(values() == initial); }};
+      auto session = i0.start_undo_session(true);
+      i0.modify_fields(*i0.find(1), [](wide_element_t& elem) { elem.values[11] = 100; }, &wide_element_t::values);
+      i0.modify_fields(*i0.find(1), [](wide_element_t& elem) { elem.values[0] = 100; });
+      i0.modify_fields(*i0.find(2), [](wide_element_t& elem) { elem.secondary = 20; elem.values[5] = 7; });
+      i0.modify_fields(*i0.find(3), [](wide_element_t& elem) { elem.secondary = 30; }, &wide_element_t::secondary);
+      BOOST_CHECK_THROW(i0.modify_fields(*i0.find(4), [](wide_element_t& elem) { elem.secondary = 5; elem.values[4] = 1; }), std::logic_error);
+      BOOST_CHECK_THROW(i0.modify_fields(*i0.find(4), [](wide_element_t& elem) { elem.secondary = 5; }, &wide_element_t::secondary), std::logic_error);
+      BOOST_TEST(i0.find(4)->secondary == 4);
+      BOOST_TEST(i0.find(4)->values[4] == 4u);
+      BOOST_TEST(i0.memory_stats().old_values == 0u);
+      BOOST_TEST(i0.memory_stats().field_values == 7u);
+      BOOST_TEST(i0.find(1)->values[11] == 100u);
+      BOOST_TEST(i0.get<1>().find(20)->id == 2);
+      BOOST_TEST(i0.get<1>().find(30)->id == 3);
+      {
+         auto session2 = i0.start_undo_session(true);
+         i0.modify(*i0.find(1), [](wide_element_t& elem) { elem.values[1] = 50; });
+         i0.modify_fields(*i0.find(1), [](wide_element_t& elem) { elem.values[2] = 50; });
+         i0.modify_fields(*i0.find(3), [](wide_element_t& elem) { elem.values[3] = 50; });
+         i0.modify_fields(*i0.find(6), [](wide_element_t& elem) { elem.secondary = 60; });
+         i0.remove(*i0.find(6));
+         session2.squash();
+      }
+      BOOST_TEST(i0.find(6) == nullptr);
+      BOOST_TEST(i0.find(3)->values[3] == 50u);
+   }
+   BOOST_TEST(values() == initial);
+   BOOST_TEST(i0.memory_stats().field_values == 0u);
+}
+
+BOOST_AUTO_TEST_CASE(test_modify_fields_random) {
+   using index_type = chainbase::undo_index<wide_element_t, test_allocator<wide_element_t>,
+                                            boost::multi_index::ordered_unique<key<&wide_element_t::id>>,
+                                            boost::multi_index::ordered_unique<key<&wide_element_t::secondary>>>;
+   index_type i0, i1;
+   std::mt19937 rng(11);
+   auto check = [&] {
+      BOOST_REQUIRE(std::equal(i0.get<1>().begin(), i0.get<1>().end(), i1.get<1>().begin(), i1.get<1>().end(),
+                               [](const auto& a, const auto& b) {
+                                  return a.id == b.id && a.secondary == b.secondary && std::memcmp(a.values, b.values, sizeof(a.values)) == 0;
+                               }));
+   };
+   for(int round = 0; round < 2000; ++round) {
+      int op = rng() % 10;
+      if(op < 3 || i1.empty()) {
+         int secondary = rng() % 500;
+         if(i1.get<1>().find(secondary) == i1.get<1>().end()) {
+            i0.emplace([&](wide_element_t& elem) { elem.secondary = secondary; });
+            i1.emplace([&](wide_element_t& elem) { elem.secondary = secondary; });
+         }
+      } else if(op < 7) {
+         auto& elem1 = *i1.get<0>().lower_bound(rng() % (i1.get<0>().rbegin()->id + 1));
+         auto& elem0 = *i0.find(elem1.id);
+         int secondary = rng() % 500;
+         int slot = rng() % 12;
+         uint64_t value = rng();
+         // A failed modify may remove the object, so only make changes that succeed
+         if(op == 6 && i1.get<1>().find(secondary) != i1.get<1>().end()) continue;
+         auto m = [&](wide_element_t& elem) { elem.values[slot] = value; if(op == 6) elem.secondary = secondary; };
+         i1.modify(elem1, m);
+         switch(rng() % 3) {
+            case 0: i0.modify_fields(elem0, m); break;
+            case 1: i0.modify_fields(elem0, m, &wide_element_t::values, &wide_element_t::secondary); break;
+            default: i0.modify(elem0, m);
+         }
+      } else if(op == 7) {
+         auto& elem1 = *i1.get<1>().lower_bound(rng() % 500);
+         if(&elem1 != &*i1.get<1>().end()) {
+            i0.remove(*i0.find(elem1.id));
+            i1.remove(elem1);
+         }
+      } else if(op == 8) {
+         switch(rng() % 4) {
+            case 0: i0.undo(); i1.undo(); break;
+            case 1: i0.squash(); i1.squash(); break;
+            case 2: i0.commit(i0.revision() - 1); i1.commit(i1.revision() - 1); break;
+            default: {
+               auto d0 = i0.last_undo_session();
+               auto d1 = i1.last_undo_session();
+               BOOST_REQUIRE_EQUAL(std::distance(d0.new_values.begin(), d0.new_values.end()),
+                                   std::distance(d1.new_values.begin(), d1.new_values.end()));
+            }
+         }
+      } else {
+         i0.start_undo_session(true).push();
+         i1.start_undo_session(true).push();
+      }
+      check();
+   }
+   i0.undo_all();
+   i1.undo_all();
+   check();
+}
+
+EXCEPTION_TEST_CASE(test_hashed_undo) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::hashed_unique<key<&test_element_t::secondary>>> i0;
+   for(int i = 0; i < 200; ++i)
+      i0.emplace([&](test_element_t& elem) { elem.secondary = i * 2; });
+   {
+   auto undo_checker = capture_state(i0);
+   auto session = i0.start_undo_session(true);
+   for(int i = 0; i < 200; i += 3)
+      i0.modify(*i0.find(i), [&](test_element_t& elem) { elem.secondary = 1000 - i * 2 - 1; });
+   for(int i = 1; i < 200; i += 3)
+      i0.remove(*i0.find(i));
+   for(int i = 0; i < 200; ++i)
+      i0.emplace([&](test_element_t& elem) { elem.secondary = -i; });
+   BOOST_TEST(i0.get<1>().size() == 333);
+   BOOST_TEST(i0.get<1>().find(1000 - 1)->id == 0);
+   BOOST_TEST(i0.get<1>().find(-199)->id == 399);
+   BOOST_TEST(std::distance(i0.get<1>().begin(), i0.get<1>().end()) == 333);
+   BOOST_CHECK_THROW(i0.modify(*i0.find(2), [](test_element_t& elem) { elem.secondary = 10; }), std::logic_error);
+   }
+   BOOST_TEST(i0.get<1>().size() == 200);
+   for(int i = 0; i < 200; ++i)
+      BOOST_TEST(i0.get<1>().find(i * 2)->id == i);
+   BOOST_TEST(std::distance(i0.get<1>().begin(), i0.get<1>().end()) == 200);
+}
+
+// Runs the same random operations on a btree index and an ordered index
+BOOST_AUTO_TEST_CASE(test_btree_random) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         chainbase::btree_unique<boost::multi_index::tag<by_secondary>, key<&test_element_t::secondary>>> i0;
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i1;
+   std::mt19937 rng(42);
+   auto check = [&] {
+      BOOST_REQUIRE_EQUAL(i0.get<1>().size(), i1.get<1>().size());
+      BOOST_REQUIRE(std::equal(i0.get<1>().begin(), i0.get<1>().end(), i1.get<1>().begin(), i1.get<1>().end(),
+                               [](const auto& a, const auto& b) { return a.id == b.id && a.secondary == b.secondary; }));
+      BOOST_REQUIRE(std::equal(i0.get<1>().rbegin(), i0.get<1>().rend(), i1.get<1>().rbegin(), i1.get<1>().rend(),
+                               [](const auto& a, const auto& b) { return a.id == b.id; }));
+      for(int i = 0; i < 20; ++i) {
+         int k = rng() % 20000;
+         auto l0 = i0.get<by_secondary>().lower_bound(k);
+         auto l1 = i1.get<1>().lower_bound(k);
+         BOOST_REQUIRE_EQUAL(l0 == i0.get<1>().end(), l1 == i1.get<1>().end());
+         if(l1 != i1.get<1>().end()) BOOST_REQUIRE_EQUAL(l0->id, l1->id);
+         auto u0 = i0.get<by_secondary>().upper_bound(k);
+         auto u1 = i1.get<1>().upper_bound(k);
+         BOOST_REQUIRE_EQUAL(u0 == i0.get<1>().end(), u1 == i1.get<1>().end());
+         if(u1 != i1.get<1>().end()) BOOST_REQUIRE_EQUAL(u0->id, u1->id);
+         BOOST_REQUIRE_EQUAL(i0.get<1>().find(k) == i0.get<1>().end(), i1.get<1>().find(k) == i1.get<1>().end());
+      }
+   };
+   auto step = [&](int count) {
+      for(int i = 0; i < count; ++i) {
+         int op = rng() % 3;
+         int value = rng() % 20000;
+         if(op == 0 || i1.empty()) {
+            bool ok = true;
+            try { i1.emplace([&](test_element_t& elem) { elem.secondary = value; }); } catch(std::logic_error&) { ok = false; }
+            if(ok) i0.emplace([&](test_element_t& elem) { elem.secondary = value; });
+            else BOOST_CHECK_THROW(i0.emplace([&](test_element_t& elem) { elem.secondary = value; }), std::logic_error);
+         } else {
+            const auto& elem1 = *i1.get<1>().lower_bound(value % (i1.get<1>().rbegin()->secondary + 1));
+            const auto& elem0 = *i0.find(elem1.id);
+            if(op == 1) {
+               bool ok = true;
+               try { i1.modify(elem1, [&](test_element_t& elem) { elem.secondary = value; }); } catch(std::logic_error&) { ok = false; }
+               if(ok) i0.modify(elem0, [&](test_element_t& elem) { elem.secondary = value; });
+               else BOOST_CHECK_THROW(i0.modify(elem0, [&](test_element_t& elem) { elem.secondary = value; }), std::logic_error);
+            } else {
+               i1.remove(elem1);
+               i0.remove(elem0);
+            }
+         }
+      }
+   };
+   step(5000);
+   check();
+   for(int round = 0; round < 20; ++round) {
+      auto session0 = i0.start_undo_session(true);
+      auto session1 = i1.start_undo_session(true);
+      step(1000);
+      check();
+      if(round % 2) {
+         session0.undo();
+         session1.undo();
+      } else {
+         session0.push();
+         session1.push();
+      }
+      check();
+   }
+   i0.undo_all();
+   i1.undo_all();
+   check();
+   // Remove everything in key order, which drains the tree from the left
+   while(!i1.empty()) {
+      i0.remove(*i0.get<1>().begin());
+      i1.remove(*i1.get<1>().begin());
+   }
+   check();
+}
+
+BOOST_AUTO_TEST_CASE(test_hashed_random) {
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::hashed_unique<boost::multi_index::tag<by_secondary>, key<&test_element_t::secondary>>> i0;
+   chainbase::undo_index<test_element_t, test_allocator<test_element_t>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::id>>,
+                         boost::multi_index::ordered_unique<key<&test_element_t::secondary>>> i1;
+   std::mt19937 rng(7);
+   auto check = [&] {
+      BOOST_REQUIRE_EQUAL(i0.get<by_secondary>().size(), i1.get<1>().size());
+      std::size_t visited = 0;
+      for(const auto& elem : i0.get<by_secondary>()) {
+         BOOST_REQUIRE_EQUAL(i1.get<1>().find(elem.secondary)->id, elem.id);
+         ++visited;
+      }
+      BOOST_REQUIRE_EQUAL(visited, i1.size());
+      for(const auto& elem : i1.get<1>())
+         BOOST_REQUIRE(&*i0.get<1>().find(elem.secondary) == i0.find(elem.id));
+      for(int i = 0; i < 50; ++i) {
+         int k = rng() % 20000;
+         BOOST_REQUIRE_EQUAL(i0.get<1>().count(k), std::size_t(i1.get<1>().find(k) != i1.get<1>().end()));
+      }
+   };
+   auto step = [&](int count) {
+      for(int i = 0; i < count; ++i) {
+         int op = rng() % 3;
+         int value = rng() % 20000;
+         if(op == 0 || i1.empty()) {
+            bool ok = true;
+            try { i1.emplace([&](test_element_t& elem) { elem.secondary = value; }); } catch(std::logic_error&) { ok = false; }
+            if(ok) i0.emplace([&](test_element_t& elem) { elem.secondary = value; });
+            else BOOST_CHECK_THROW(i0.emplace([&](test_element_t& elem) { elem.secondary = value; }), std::logic_error);
+         } else {
+            const auto& elem1 = *i1.get<1>().lower_bound(value % (i1.get<1>().rbegin()->secondary + 1));
+            const auto& elem0 = *i0.find(elem1.id);
+            if(op == 1) {
+               bool ok = true;
+               try { i1.modify(elem1, [&](test_element_t& elem) { elem.secondary = value; }); } catch(std::logic_error&) { ok = false; }
+               if(ok) i0.modify(elem0, [&](test_element_t& elem) { elem.secondary = value; });
+               else BOOST_CHECK_THROW(i0.modify(elem0, [&](test_element_t& elem) { elem.secondary = value; }), std::logic_error);
+            } else {
+               i1.remove(elem1);
+               i0.remove(elem0);
+            }
+         }
+      }
+   };
+   step(3000);
+   check();
+   for(int round = 0; round < 20; ++round) {
+      auto session0 = i0.start_undo_session(true);
+      auto session1 = i1.start_undo_session(true);
+      step(1000);
+      check();
+      if(round % 2) {
+         session0.undo();
+         session1.undo();
+      } else {
+         session0.push();
+         session1.push();
+      }
+      check();
+   }
+   i0.undo_all();
+   i1.undo_all();
+   check();
+}
+
 BOOST_AUTO_TEST_SUITE_END()